@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "check_syscalls.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (1<<20)
+
+//Drops the (unused) blocks past the current one, and adds a new block
+//with room for at least size bytes.  Block sizes at least double, so
+//only a few blocks are ever needed.
+void _arena_add_block(struct arena *a, int64_t size) {
+  int64_t i, total = 0;
+  for (i=a->cur+1; i<a->num_blocks; i++) free(a->blocks[i].data);
+  if (a->num_blocks) a->num_blocks = a->cur+1;
+  for (i=0; i<a->num_blocks; i++) total += a->blocks[i].size;
+  if (size < total) size = total;
+  if (size < ARENA_MIN_BLOCK) size = ARENA_MIN_BLOCK;
+  check_realloc_s(a->blocks, sizeof(struct arena_block), a->num_blocks+1);
+  a->blocks[a->num_blocks].data = check_realloc(NULL, size,
+						"Allocating scratch memory.");
+  a->blocks[a->num_blocks].size = size;
+  a->blocks[a->num_blocks].used = 0;
+  a->cur = a->num_blocks;
+  a->num_blocks++;
+}
+
+void *arena_alloc(struct arena *a, int64_t size) {
+  struct arena_block *b;
+  void *ptr;
+  size = (size + ARENA_ALIGN - 1) & ~((int64_t)ARENA_ALIGN - 1);
+  if (!a->num_blocks || a->blocks[a->cur].used + size > a->blocks[a->cur].size) {
+    if (a->cur+1 < a->num_blocks && a->blocks[a->cur+1].size >= size) {
+      a->cur++;
+      a->blocks[a->cur].used = 0;
+    }
+    else _arena_add_block(a, size);
+  }
+  b = a->blocks + a->cur;
+  ptr = b->data + b->used;
+  b->used += size;
+  a->in_use += size;
+  if (a->in_use > a->peak) a->peak = a->in_use;
+  return ptr;
+}
+
+struct arena_mark arena_mark(struct arena *a) {
+  struct arena_mark m = {a->cur, 0, a->in_use};
+  if (a->num_blocks) m.used = a->blocks[a->cur].used;
+  return m;
+}
+
+//Frees everything allocated since the mark was taken.
+void arena_release(struct arena *a, struct arena_mark m) {
+  int64_t i;
+  for (i=m.block+1; i<=a->cur && i<a->num_blocks; i++) a->blocks[i].used = 0;
+  a->cur = m.block;
+  if (a->num_blocks) a->blocks[a->cur].used = m.used;
+  a->in_use = m.in_use;
+}
+
+//Frees everything; if the arena had to grow past one block, the blocks
+//are replaced with a single one big enough for the peak usage so far.
+void arena_reset(struct arena *a) {
+  int64_t i;
+  if (a->num_blocks > 1) {
+    for (i=0; i<a->num_blocks; i++) free(a->blocks[i].data);
+    a->num_blocks = a->cur = 0;
+    _arena_add_block(a, a->peak);
+  }
+  a->cur = a->in_use = 0;
+  if (a->num_blocks) a->blocks[0].used = 0;
+}
+
+void arena_free(struct arena *a) {
+  int64_t i;
+  for (i=0; i<a->num_blocks; i++) free(a->blocks[i].data);
+  free(a->blocks);
+  memset(a, 0, sizeof(struct arena));
+}
@@ -0,0 +1,31 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#include <stdint.h>
+
+/* Bump allocator for scratch memory.  Allocations are released in LIFO
+   order by returning to a mark taken with arena_mark().  Memory comes in
+   blocks that never move, so earlier allocations stay valid as the arena
+   grows. */
+struct arena_block {
+  char *data;
+  int64_t size, used;
+};
+
+struct arena {
+  struct arena_block *blocks;
+  int64_t num_blocks, cur, in_use, peak;
+};
+
+struct arena_mark {
+  int64_t block, used, in_use;
+};
+
+void *arena_alloc(struct arena *a, int64_t size);
+struct arena_mark arena_mark(struct arena *a);
+void arena_release(struct arena *a, struct arena_mark m);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#define arena_alloc_s(a,x,y,z) { (x) = arena_alloc((a),((int64_t)(y))*((int64_t)(z))); }
+
+#endif /* _ARENA_H_ */
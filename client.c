@@ -1382,6 +1382,7 @@ void client(int64_t type) {
       if (CLIENT_DEBUG) fprintf(stderr, "Found %"PRId64" fofs in chunk %"PRId64"\n", num_all_fofs, chunk);
       if (profile_out) {
 	fprintf(profile_out, "[Prof] S%"PRId64",C%"PRId64" %"PRId64"s: %"PRId64" fofs, %"PRId64" particles, %"PRId64"s for conf.\n", snap, chunk, (time_middle-time_start), num_all_fofs, num_p, (time_end-time_middle));
+	fprintf(profile_out, "[Prof] S%"PRId64",C%"PRId64" %.3fs particle sort, %.3fs tree build, %.3fs FOF linking.\n", snap, chunk, particle_sort_time, particle_tree_time, particle_link_time);
 	fflush(profile_out);
       }
     }
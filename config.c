@@ -37,6 +37,7 @@ void setup_config(void) {
   getrlimit(RLIMIT_CORE, &rlp);
   rlp.rlim_cur = rlp.rlim_max;
   setrlimit(RLIMIT_CORE, &rlp);
+  if (NUM_THREADS < 1) NUM_THREADS = 1;
   if (NUM_WRITERS < FORK_PROCESSORS_PER_MACHINE)
     NUM_WRITERS = FORK_PROCESSORS_PER_MACHINE;
 
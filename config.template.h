@@ -81,6 +81,7 @@ real(OVERLAP_LENGTH, 3.0);
 integer(NUM_WRITERS, 1);
 integer(FORK_READERS_FROM_WRITERS, 0);
 integer(FORK_PROCESSORS_PER_MACHINE, 1);
+integer(NUM_THREADS, 1); //Threads per analysis task
 
 string(OUTPUT_FORMAT, "BOTH");
 integer(DELETE_BINARY_OUTPUT_AFTER_FINISHED, 0);
@@ -91,6 +92,9 @@ integer(SHAPE_ITERATIONS, 10);
 integer(WEIGHTED_SHAPES, 1);
 integer(BOUND_PROPS, 1);
 integer(BOUND_OUT_TO_HALO_EDGE, 0);
+integer(NESTED_HALO_ORDER, 0); //Order each FOF's particles so halos and their substructure are contiguous
+integer(UNBINDING_ITERATIONS, 1); //Unbinding passes; later passes remove the potentials of unbound particles
+integer(FMM_MIN_PARTICLES, 0); //Use the fast multipole method for halos with at least this many particles (0 = never)
 integer(DO_MERGER_TREE_ONLY, 0);
 integer(IGNORE_PARTICLE_IDS, 0);
 integer(EXACT_LL_CALC, 0);
@@ -111,6 +115,9 @@ integer(ART_VARIANT, 0);
 
 real(FOF_FRACTION, 0.7);
 real(FOF_LINKING_LENGTH, 0.28);
+integer(FOF_GRID, 1); //Use a cell grid instead of the tree for 3D FOF linking
+integer(MORTON_SORT_PARTICLES, 0); //Sort particles along a Morton curve first
+integer(REFIT_SUBFOF_TREES, 0); //Refit subFOF trees from the parent's tree (faster, but catalogs differ slightly)
 real(INITIAL_METRIC_SCALING, 1);
 real(INCLUDE_HOST_POTENTIAL_RATIO, 0.3);
 integer(TEMPORAL_HALO_FINDING, 1);
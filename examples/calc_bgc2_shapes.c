@@ -95,7 +95,7 @@ int main(int argc, char **argv) {
       if (total_mass > 0)
  	for (int64_t l=0; l<3; l++) bulkvel[l] /= total_mass;
       if (BOUND_PROPS) {
- 	compute_potential(po, grps[j].npart);
+ 	compute_potential(po, grps[j].npart, 1);
  	compute_kinetic_energy(po, grps[j].npart, bulkvel, h.pos);
       }
       qsort(po, grps[j].npart, sizeof(struct potential), dist_compare);
@@ -49,7 +49,7 @@ void calc_potentials(void) {
       po[j].pe = po[j].ke = 0;
     }
     compute_kinetic_energy(po, the_h->num_p, the_h->pos+3, the_h->pos);
-    compute_potential(po, the_h->num_p);
+    compute_potential(po, the_h->num_p, 1);
     count=0;
     for (j=0; j<the_h->num_p; j++) if (po[j].pe >= po[j].ke) count++;
     printf("%"PRId64" %"PRId64"\n", the_h->id, count);
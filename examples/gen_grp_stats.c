@@ -78,7 +78,7 @@ void calc_potentials(double dm_mass) {
       po[j].type = p[the_h->p_start+j].type;
     }
     compute_kinetic_energy(po, the_h->num_p, the_h->pos+3, the_h->pos);
-    compute_potential(po, the_h->num_p);
+    compute_potential(po, the_h->num_p, 1);
     count=0;
 
     int64_t n[3]={0};
@@ -7,6 +7,7 @@
       #define FAST3TREE_POINTS_PER_LEAF X //Optional, num. points per leaf node
       #define FAST3TREE_PREFIX XYZ //Optional, if using multiple different trees
       #define FAST3TREE_FLOATTYPE float //Optional: or double, or long double
+      #define FAST3TREE_COMPACT //Optional: faster sphere/nearest-neighbor searches
       #include "fast3tree.c"
 
 
@@ -17,9 +18,33 @@
    Rebuild a fast3tree from a new (or the same) list of points:
       void fast3tree_rebuild(struct fast3tree *t, int64_t n, FAST3TREE_TYPE *p);
 
+   To use up to N threads when (re)building large trees, set
+      t->num_threads = N;
+   The tree is the same for any number of threads.
+
    Rebuilds the tree boundaries, but keeps structure the same:
       void fast3tree_maxmin_rebuild(struct fast3tree *t);
 
+   Build a tree for points p[0..n-1] that are also in another tree
+   (parent), reusing the parent's structure instead of splitting from
+   scratch.  First, while the points still have the coordinates that the
+   parent was built with, find the parent leaves that they belong to:
+      void fast3tree_find_leaves(struct fast3tree *parent, int64_t n,
+              FAST3TREE_TYPE *p, int64_t *leaves);
+   Then (after coordinates have changed, if needed), build the tree by
+   pruning the parent to those leaves and refitting node bounds:
+      int fast3tree_refit(struct fast3tree *t, struct fast3tree *parent,
+              int64_t n, FAST3TREE_TYPE *p, const int64_t *leaves);
+   Refitting requires p to be in the same order as in the parent (e.g.,
+   after a stable sort of the parent's points).  It returns 0 if not, or
+   if the new leaves would hold too few points on average; the tree must
+   then be built with fast3tree_rebuild() instead.
+
+   After reordering the points within a leaf (without changing the set
+   of points in it), refreshes the copy of points n..n+num-1 kept for
+   searches; a no-op unless FAST3TREE_COMPACT is defined:
+      void fast3tree_points_moved(struct fast3tree *t, int64_t n, int64_t num);
+
    Frees the tree memory and sets tree pointer to NULL.
       void fast3tree_free(struct fast3tree **t);
 
@@ -32,7 +57,10 @@
               struct fast3tree_results *res, float c[FD], float r);
 
    Find all points within a sphere centered at c[FD] with radius r,
-   assuming periodic boundary conditions:
+   assuming periodic boundary conditions with the root node's extent as
+   the period.  Distances are minimum-image distances, so each point is
+   found at most once, in a single pass over the tree.  Returns 0 (with
+   no results) if r is more than half the period:
       int fast3tree_find_sphere_periodic(struct fast3tree *t, 
               struct fast3tree_results *res, float c[FD], float r);
 
@@ -50,7 +78,56 @@
    Free the results structure returned by fast3tree_find_sphere:
       void fast3tree_results_free(struct fast3tree_results *res);
 
+   Allocate a (cleared) bitset with one mark per tree node; free with free():
+      uint8_t *fast3tree_marks_init(struct fast3tree *t);
+
+   Mark a node and all of its children in a bitset:
+      void fast3tree_mark_node(struct fast3tree *t, uint8_t *marks,
+              struct tree3_node *n);
+
+   Find points within a sphere, returning only one point from each marked
+   node; if do_marking is set, nodes entirely inside the sphere are marked:
+      int fast3tree_find_sphere_marked(struct fast3tree *t,
+              struct fast3tree_results *res, float c[FD], float r,
+              int periodic, int do_marking, uint8_t *marks);
+
+   For each of num_q tree points t->points[q[i]] (or t->points[i] if q is
+   NULL), find the distance to its k-th nearest neighbor, ignoring points
+   at zero distance (0 if there are none).  Each search starts from the
+   point's own leaf and works upward, so that distant nodes are rarely
+   visited.  Queries are split among t->num_threads threads:
+      void fast3tree_find_knn_distances(struct fast3tree *t, int64_t num_q,
+              const int64_t *q, int64_t k, float *dists);
+
+   Link all pairs of points closer than r (e.g., for friends-of-friends),
+   by calling link(data, i, j) with indices into t->points.  Not every
+   pair is passed on, but the pairs that are connect exactly the same
+   groups of points.  With t->num_threads > 1, link() is called from
+   several threads at once:
+      void fast3tree_link_pairs(struct fast3tree *t, float r,
+              void (*link)(void *data, int64_t i, int64_t j), void *data);
+
    END PUBLIC METHODS
+
+   COMPACT LAYOUT:
+   With FAST3TREE_COMPACT, each (re)build also stores a copy of the node
+   bounds in pre-order (left child = node+1; each node stores the index
+   just past its subtree), with points given by offset+count and parents in
+   a separate array.  Nodes take about half the memory of struct tree3_node,
+   and fast3tree_find_sphere() and fast3tree_find_next_closest_distance()
+   use them when possible, with the same results.  A copy of the point
+   coordinates is also kept as separate arrays for each dimension, so that
+   leaf distances are computed with AVX-512 or AVX2 instructions when
+   compiled for them (e.g., with -march=native).  Code that modifies node
+   bounds or point positions directly must call fast3tree_maxmin_rebuild()
+   afterwards.
+
+   CONCURRENT QUERIES:
+   Searches never modify the tree, so a tree may be searched by many
+   threads at once as long as it is not rebuilt in the meantime, and each
+   thread uses its own fast3tree_results structure.  Node marks are kept in
+   caller-owned bitsets rather than in the tree; marks are set atomically,
+   so threads may share a bitset or use separate ones.
 */
 
 #ifndef _FAST3TREE_C_
@@ -62,6 +139,10 @@
 #include <math.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
+#if defined(FAST3TREE_COMPACT) && (defined(__AVX2__) || defined(__AVX512F__))
+#include <immintrin.h>
+#endif
 
 #ifndef FAST3TREE_PREFIX
 #define FAST3TREE_PREFIX
@@ -79,7 +160,7 @@
 #define float FAST3TREE_FLOATTYPE
 #endif /* FAST3TREE_FLOATTYPE */
 
-#define FAST3TREE_MARKED 1 //Flag for marked nodes
+#define FAST3TREE_MARK_TST(m,i) ((m)[(i)>>3] & (1<<((i)&7)))
 
 #ifndef FAST3TREE_TYPE
 #error Usage:
@@ -116,6 +197,18 @@ void fast3tree_rebuild(struct fast3tree *t, int64_t n, FAST3TREE_TYPE *p);
 #define fast3tree_maxmin_rebuild _F3TN(FAST3TREE_PREFIX,fast3tree_maxmin_rebuild)
 void fast3tree_maxmin_rebuild(struct fast3tree *t);
 
+#undef fast3tree_find_leaves
+#define fast3tree_find_leaves _F3TN(FAST3TREE_PREFIX,fast3tree_find_leaves)
+void fast3tree_find_leaves(struct fast3tree *parent, int64_t n, FAST3TREE_TYPE *p, int64_t *leaves);
+
+#undef fast3tree_refit
+#define fast3tree_refit _F3TN(FAST3TREE_PREFIX,fast3tree_refit)
+int fast3tree_refit(struct fast3tree *t, struct fast3tree *parent, int64_t n, FAST3TREE_TYPE *p, const int64_t *leaves);
+
+#undef fast3tree_points_moved
+#define fast3tree_points_moved _F3TN(FAST3TREE_PREFIX,fast3tree_points_moved)
+void fast3tree_points_moved(struct fast3tree *t, int64_t n, int64_t num);
+
 #undef fast3tree_results_init
 #define fast3tree_results_init _F3TN(FAST3TREE_PREFIX,fast3tree_results_init)
 struct fast3tree_results *fast3tree_results_init(void);
@@ -139,7 +232,15 @@ int fast3tree_find_sphere_periodic(struct fast3tree *t,
 #undef fast3tree_find_sphere_marked
 #define fast3tree_find_sphere_marked _F3TN(FAST3TREE_PREFIX,fast3tree_find_sphere_marked)
 int fast3tree_find_sphere_marked(struct fast3tree *t,
-				 struct fast3tree_results *res, float c[FAST3TREE_DIM], float r, int periodic, int do_marking);
+				 struct fast3tree_results *res, float c[FAST3TREE_DIM], float r, int periodic, int do_marking, uint8_t *marks);
+
+#undef fast3tree_marks_init
+#define fast3tree_marks_init _F3TN(FAST3TREE_PREFIX,fast3tree_marks_init)
+uint8_t *fast3tree_marks_init(struct fast3tree *t);
+
+#undef fast3tree_mark_node
+#define fast3tree_mark_node _F3TN(FAST3TREE_PREFIX,fast3tree_mark_node)
+void fast3tree_mark_node(struct fast3tree *t, uint8_t *marks, struct tree3_node *n);
 
 #undef fast3tree_find_inside_of_box
 #define fast3tree_find_inside_of_box _F3TN(FAST3TREE_PREFIX,fast3tree_find_inside_of_box)
@@ -149,6 +250,14 @@ void fast3tree_find_inside_of_box(struct fast3tree *t, struct fast3tree_results
 #define fast3tree_find_outside_of_box _F3TN(FAST3TREE_PREFIX,fast3tree_find_outside_of_box)
 void fast3tree_find_outside_of_box(struct fast3tree *t, struct fast3tree_results *res, float b[2*FAST3TREE_DIM]);
 
+#undef fast3tree_find_knn_distances
+#define fast3tree_find_knn_distances _F3TN(FAST3TREE_PREFIX,fast3tree_find_knn_distances)
+void fast3tree_find_knn_distances(struct fast3tree *t, int64_t num_q, const int64_t *q, int64_t k, float *dists);
+
+#undef fast3tree_link_pairs
+#define fast3tree_link_pairs _F3TN(FAST3TREE_PREFIX,fast3tree_link_pairs)
+void fast3tree_link_pairs(struct fast3tree *t, float r, void (*link)(void *data, int64_t i, int64_t j), void *data);
+
 #undef fast3tree_results_clear
 #define fast3tree_results_clear _F3TN(FAST3TREE_PREFIX,fast3tree_results_clear)
 void fast3tree_results_clear(struct fast3tree_results *res);
@@ -169,7 +278,7 @@ struct fast3tree_default_point { float pos[FAST3TREE_DIM]; };
 struct tree3_node {
   float min[FAST3TREE_DIM], max[FAST3TREE_DIM];
   int64_t num_points;
-  int16_t div_dim, flags;
+  int16_t div_dim;
   struct tree3_node *left, *right, *parent;
 #ifdef FAST3TREE_EXTRA_INFO
   FAST3TREE_EXTRA_INFO;
@@ -177,12 +286,28 @@ struct tree3_node {
   FAST3TREE_TYPE *points;
 };
 
+#ifdef FAST3TREE_COMPACT
+#undef tree3_cnode
+#define tree3_cnode _F3TN(FAST3TREE_PREFIX,tree3_cnode)
+struct tree3_cnode {
+  float min[FAST3TREE_DIM], max[FAST3TREE_DIM];
+  int32_t offset, num_points, skip, div_dim;
+};
+#endif /* FAST3TREE_COMPACT */
+
 struct fast3tree {
   FAST3TREE_TYPE *points;
   int64_t num_points;
   struct tree3_node *root;
   int64_t num_nodes;
   int64_t allocated_nodes;
+  int64_t num_threads;
+#ifdef FAST3TREE_COMPACT
+  struct tree3_cnode *cnodes;
+  int32_t *cparent;
+  int64_t num_cnodes;
+  float *cpos; //cpos[dim*num_points + i] = points[i].pos[dim]
+#endif /* FAST3TREE_COMPACT */
 };
 
 struct fast3tree_results {
@@ -206,6 +331,10 @@ void _fast3tree_build(struct fast3tree *t);
 #define _fast3tree_maxmin_rebuild _F3TN(FAST3TREE_PREFIX,_fast3tree_maxmin_rebuild)
 void _fast3tree_maxmin_rebuild(struct tree3_node *n);
 
+#undef _fast3tree_build_compact
+#define _fast3tree_build_compact _F3TN(FAST3TREE_PREFIX,_fast3tree_build_compact)
+void _fast3tree_build_compact(struct fast3tree *t);
+
 
 
 struct fast3tree *fast3tree_init(int64_t n, FAST3TREE_TYPE *p) {
@@ -225,6 +354,17 @@ void fast3tree_rebuild(struct fast3tree *t, int64_t n, FAST3TREE_TYPE *p) {
 
 void fast3tree_maxmin_rebuild(struct fast3tree *t) {
   _fast3tree_maxmin_rebuild(t->root);
+  _fast3tree_build_compact(t);
+}
+
+void fast3tree_points_moved(struct fast3tree *t, int64_t n, int64_t num) {
+#ifdef FAST3TREE_COMPACT
+  int64_t i, j;
+  if (!t->num_cnodes) return;
+  for (i=n; i<n+num; i++)
+    for (j=0; j<FAST3TREE_DIM; j++)
+      t->cpos[j*t->num_points + i] = t->points[i].pos[j];
+#endif /* FAST3TREE_COMPACT */
 }
 
 #undef fast3tree_free
@@ -234,6 +374,11 @@ void fast3tree_free(struct fast3tree **t) {
   struct fast3tree *u = *t;
   if (u) {
     free(u->root);
+#ifdef FAST3TREE_COMPACT
+    free(u->cnodes);
+    free(u->cparent);
+    free(u->cpos);
+#endif /* FAST3TREE_COMPACT */
     free(u);
   }
   *t = NULL;
@@ -326,21 +471,28 @@ static inline void _fast3tree_check_results_space(const struct tree3_node *n, st
 }
 
 
-#undef _fast3tree_mark_node
-#define _fast3tree_mark_node _F3TN(FAST3TREE_PREFIX,_fast3tree_mark_node)
-static inline void _fast3tree_mark_node(struct tree3_node *n, int16_t mark) {
-  if (n->flags == mark) return;
-  n->flags = mark;
+#undef _fast3tree_set_mark
+#define _fast3tree_set_mark _F3TN(FAST3TREE_PREFIX,_fast3tree_set_mark)
+static inline void _fast3tree_set_mark(uint8_t *marks, int64_t i) {
+  if (!FAST3TREE_MARK_TST(marks, i))
+    __sync_fetch_and_or(marks + (i>>3), (uint8_t)(1<<(i&7)));
+}
+
+uint8_t *fast3tree_marks_init(struct fast3tree *t) {
+  int64_t size = (t->num_nodes+7)/8;
+  uint8_t *marks = _fast3tree_check_realloc(NULL, size, "Allocating fast3tree marks");
+  memset(marks, 0, size);
+  return marks;
+}
+
+void fast3tree_mark_node(struct fast3tree *t, uint8_t *marks, struct tree3_node *n) {
+  int64_t i = n - t->root;
+  if (FAST3TREE_MARK_TST(marks, i)) return;
+  _fast3tree_set_mark(marks, i);
   if (n->div_dim > -1) {
-    _fast3tree_mark_node(n->left, mark);
-    _fast3tree_mark_node(n->right, mark);
+    fast3tree_mark_node(t, marks, n->left);
+    fast3tree_mark_node(t, marks, n->right);
   }
-  /*  while (n->parent && n != n->parent) {
-    struct tree3_node *o = (n->parent->left == n) ? n->parent->right : n->parent->left;
-    if (o->flags==mark) n->parent->flags = mark;
-    else break;
-    n = n->parent;
-    }*/
 }
 
 #undef _fast3tree_find_sphere
@@ -437,8 +589,221 @@ struct fast3tree_results *fast3tree_results_init(void) {
   return res;
 }
 
+#ifdef FAST3TREE_COMPACT
+#undef _fast3tree_cbox_not_intersect_sphere
+#define _fast3tree_cbox_not_intersect_sphere \
+  _F3TN(FAST3TREE_PREFIX,_fast3tree_cbox_not_intersect_sphere)
+static inline int _fast3tree_cbox_not_intersect_sphere(const struct tree3_cnode *node, const float c[FAST3TREE_DIM], const float r) {
+  int i;
+  float d = 0, e;
+  const float r2 = r*r;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    if ((e = c[i]-node->min[i])<0) {
+      d+=e*e;
+      if (d >= r2) return 1;
+    } else if ((e = c[i]-node->max[i])>0) {
+      d+=e*e;
+      if (d >= r2) return 1;
+    }
+  }
+  return 0;
+}
+
+#undef _fast3tree_cbox_inside_sphere
+#define _fast3tree_cbox_inside_sphere _F3TN(FAST3TREE_PREFIX,_fast3tree_cbox_inside_sphere)
+static inline int _fast3tree_cbox_inside_sphere(const struct tree3_cnode *node, const float c[FAST3TREE_DIM], const float r) {
+  int i;
+  float dx, dx2, dist = 0, r2 = r*r;
+  if (fabs(c[0]-node->min[0]) > r) return 0; //Rapid short-circuit.
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    dx = node->min[i] - c[i];
+    dx *= dx;
+    dx2 = c[i]-node->max[i];
+    dx2 *= dx2;
+    if (dx2 > dx) dx = dx2;
+    dist += dx;
+    if (dist > r2) return 0;
+  }
+  return 1;
+}
+
+/* Leaf kernels over the per-dimension coordinate copies.  Distances are
+   summed over dimensions in the same order as elsewhere (and without fused
+   multiply-adds), so that results are identical for every build. */
+#undef _fast3tree_leaf_sphere
+#define _fast3tree_leaf_sphere _F3TN(FAST3TREE_PREFIX,_fast3tree_leaf_sphere)
+static inline int64_t _fast3tree_leaf_sphere(const struct fast3tree *t, const struct tree3_cnode *n, const float c[FAST3TREE_DIM], const float r2, FAST3TREE_TYPE **out) {
+  int64_t j, k=0, num_out=0;
+  float dist, dx;
+  const float *x = t->cpos + n->offset;
+  FAST3TREE_TYPE *p = t->points + n->offset;
+#if defined(__AVX512F__)
+  __m512 vd, vx, vr2 = _mm512_set1_ps(r2);
+  __mmask16 m;
+  for (; k+16<=n->num_points; k+=16) {
+    vd = _mm512_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm512_sub_ps(_mm512_set1_ps(c[j]), _mm512_loadu_ps(x + j*t->num_points + k));
+      vd = _mm512_add_ps(vd, _mm512_mul_ps(vx, vx));
+    }
+    for (m = _mm512_cmp_ps_mask(vd, vr2, _CMP_LT_OQ); m; m &= m-1)
+      out[num_out++] = p + k + __builtin_ctz(m);
+  }
+#elif defined(__AVX2__)
+  __m256 vd, vx, vr2 = _mm256_set1_ps(r2);
+  int m;
+  for (; k+8<=n->num_points; k+=8) {
+    vd = _mm256_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm256_sub_ps(_mm256_set1_ps(c[j]), _mm256_loadu_ps(x + j*t->num_points + k));
+      vd = _mm256_add_ps(vd, _mm256_mul_ps(vx, vx));
+    }
+    for (m = _mm256_movemask_ps(_mm256_cmp_ps(vd, vr2, _CMP_LT_OQ)); m; m &= m-1)
+      out[num_out++] = p + k + __builtin_ctz(m);
+  }
+#endif /* __AVX512F__, __AVX2__ */
+  for (; k<n->num_points; k++) {
+    dist = 0;
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      dx = c[j] - x[j*t->num_points + k];
+      dist += dx*dx;
+    }
+    if (dist < r2) out[num_out++] = p + k;
+  }
+  return num_out;
+}
+
+//Squared distances to points offset..offset+num-1, for k-NN searches.
+#undef _fast3tree_leaf_dists
+#define _fast3tree_leaf_dists _F3TN(FAST3TREE_PREFIX,_fast3tree_leaf_dists)
+static inline void _fast3tree_leaf_dists(const struct fast3tree *t, int64_t offset, int64_t num, const float c[FAST3TREE_DIM], float *d) {
+  int64_t j, k=0;
+  float dist, dx;
+  const float *x = t->cpos + offset;
+#if defined(__AVX512F__)
+  __m512 vd, vx;
+  for (; k+16<=num; k+=16) {
+    vd = _mm512_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm512_sub_ps(_mm512_set1_ps(c[j]), _mm512_loadu_ps(x + j*t->num_points + k));
+      vd = _mm512_add_ps(vd, _mm512_mul_ps(vx, vx));
+    }
+    _mm512_storeu_ps(d+k, vd);
+  }
+#elif defined(__AVX2__)
+  __m256 vd, vx;
+  for (; k+8<=num; k+=8) {
+    vd = _mm256_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm256_sub_ps(_mm256_set1_ps(c[j]), _mm256_loadu_ps(x + j*t->num_points + k));
+      vd = _mm256_add_ps(vd, _mm256_mul_ps(vx, vx));
+    }
+    _mm256_storeu_ps(d+k, vd);
+  }
+#endif /* __AVX512F__, __AVX2__ */
+  for (; k<num; k++) {
+    dist = 0;
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      dx = c[j] - x[j*t->num_points + k];
+      dist += dx*dx;
+    }
+    d[k] = dist;
+  }
+}
+
+//Returns the smaller of r2 and the smallest squared distance in the leaf.
+#undef _fast3tree_leaf_min_dist
+#define _fast3tree_leaf_min_dist _F3TN(FAST3TREE_PREFIX,_fast3tree_leaf_min_dist)
+static inline float _fast3tree_leaf_min_dist(const struct fast3tree *t, const struct tree3_cnode *n, const float c[FAST3TREE_DIM], float r2) {
+  int64_t j, k=0;
+  float dist, dx;
+  const float *x = t->cpos + n->offset;
+#if defined(__AVX512F__)
+  __m512 vd, vx, vmin = _mm512_set1_ps(r2);
+  for (; k+16<=n->num_points; k+=16) {
+    vd = _mm512_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm512_sub_ps(_mm512_set1_ps(c[j]), _mm512_loadu_ps(x + j*t->num_points + k));
+      vd = _mm512_add_ps(vd, _mm512_mul_ps(vx, vx));
+    }
+    vmin = _mm512_min_ps(vmin, vd);
+  }
+  r2 = _mm512_reduce_min_ps(vmin);
+#elif defined(__AVX2__)
+  float lanes[8];
+  __m256 vd, vx, vmin = _mm256_set1_ps(r2);
+  for (; k+8<=n->num_points; k+=8) {
+    vd = _mm256_setzero_ps();
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      vx = _mm256_sub_ps(_mm256_set1_ps(c[j]), _mm256_loadu_ps(x + j*t->num_points + k));
+      vd = _mm256_add_ps(vd, _mm256_mul_ps(vx, vx));
+    }
+    vmin = _mm256_min_ps(vmin, vd);
+  }
+  _mm256_storeu_ps(lanes, vmin);
+  for (j=0; j<8; j++) if (lanes[j] < r2) r2 = lanes[j];
+#endif /* __AVX512F__, __AVX2__ */
+  for (; k<n->num_points; k++) {
+    dist = 0;
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      dx = c[j] - x[j*t->num_points + k];
+      dist += dx*dx;
+    }
+    if (dist < r2) r2 = dist;
+  }
+  return r2;
+}
+
+/* Same as _fast3tree_find_sphere(), but walks the compact nodes in order,
+   jumping past subtrees that cannot contain any results. */
+#undef _fast3tree_find_sphere_compact
+#define _fast3tree_find_sphere_compact _F3TN(FAST3TREE_PREFIX,_fast3tree_find_sphere_compact)
+void _fast3tree_find_sphere_compact(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], const float r) {
+  int64_t i=0;
+  float r2 = r*r;
+  const struct tree3_cnode *n;
+#if FAST3TREE_DIM < 6
+  int64_t k;
+  FAST3TREE_TYPE *p;
+#endif /* FAST3TREE_DIM < 6 */
+
+  while (i < t->num_cnodes) {
+    n = t->cnodes + i;
+    if (_fast3tree_cbox_not_intersect_sphere(n,c,r)) { i = n->skip; continue; }
+    if (res->num_points + n->num_points > res->num_allocated_points) {
+      res->num_allocated_points = res->num_points + n->num_points + 1000;
+      res->points = _fast3tree_check_realloc(res->points,
+ res->num_allocated_points * sizeof(FAST3TREE_TYPE *), "Allocating fast3tree results");
+    }
+#if FAST3TREE_DIM < 6
+    if (_fast3tree_cbox_inside_sphere(n,c,r)) { /* Entirely inside sphere */
+      p = t->points + n->offset;
+      for (k=0; k<n->num_points; k++)
+	res->points[res->num_points+k] = p+k;
+      res->num_points += n->num_points;
+      i = n->skip;
+      continue;
+    }
+#endif /* FAST3TREE_DIM < 6 */
+
+    if (n->div_dim < 0) { /* Leaf node */
+      res->num_points += _fast3tree_leaf_sphere(t, n, c, r2, res->points + res->num_points);
+      i = n->skip;
+      continue;
+    }
+    i++;
+  }
+}
+#endif /* FAST3TREE_COMPACT */
+
 static inline void fast3tree_find_sphere(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], float r) {
   res->num_points = 0;
+#ifdef FAST3TREE_COMPACT
+  if (t->num_cnodes) {
+    _fast3tree_find_sphere_compact(t, res, c, r);
+    return;
+  }
+#endif /* FAST3TREE_COMPACT */
   _fast3tree_find_sphere(t->root, res, c, r);
 }
 
@@ -448,18 +813,71 @@ inline void fast3tree_find_sphere_skip(struct fast3tree *t, struct fast3tree_res
 }
 
 
-/* Guaranteed to be stable with respect to floating point round-off errors.*/
-#undef _fast3tree_find_sphere_offset
-#define _fast3tree_find_sphere_offset _F3TN(FAST3TREE_PREFIX,_fast3tree_find_sphere_offset)
-void _fast3tree_find_sphere_offset(struct tree3_node *n, struct fast3tree_results *res, float c[FAST3TREE_DIM], float c2[FAST3TREE_DIM], float o[FAST3TREE_DIM], const float r, const int marked, const int do_marking) {
+/* Periodic box-sphere tests.  c2[] holds the image of the center that
+   lies across the periodic boundary in each dimension where the sphere
+   crosses it (and c[] elsewhere); each dimension uses whichever image is
+   closer to the node. */
+#undef _fast3tree_box_not_intersect_sphere_periodic
+#define _fast3tree_box_not_intersect_sphere_periodic \
+  _F3TN(FAST3TREE_PREFIX,_fast3tree_box_not_intersect_sphere_periodic)
+static inline int _fast3tree_box_not_intersect_sphere_periodic(const struct tree3_node *node, const float c[FAST3TREE_DIM], const float c2[FAST3TREE_DIM], const float r) {
+  int i;
+  float d = 0, e, e2;
+  const float r2 = r*r;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    e = node->min[i] - c[i];
+    if (e < c[i] - node->max[i]) e = c[i] - node->max[i];
+    if (e > 0 && c2[i] != c[i]) {
+      e2 = node->min[i] - c2[i];
+      if (e2 < c2[i] - node->max[i]) e2 = c2[i] - node->max[i];
+      if (e2 < e) e = e2;
+    }
+    if (e > 0) {
+      d += e*e;
+      if (d >= r2) return 1;
+    }
+  }
+  return 0;
+}
+
+#undef _fast3tree_box_inside_sphere_periodic
+#define _fast3tree_box_inside_sphere_periodic \
+  _F3TN(FAST3TREE_PREFIX,_fast3tree_box_inside_sphere_periodic)
+static inline int _fast3tree_box_inside_sphere_periodic(const struct tree3_node *node, const float c[FAST3TREE_DIM], const float c2[FAST3TREE_DIM], const float r) {
+  int i;
+  float d = 0, e, e2;
+  const float r2 = r*r;
+  if (node->max[0] - node->min[0] > 2.0f*r) return 0; //Rapid short-circuit.
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    e = fabs(c[i] - node->min[i]);
+    if (e < fabs(c[i] - node->max[i])) e = fabs(c[i] - node->max[i]);
+    if (c2[i] != c[i]) {
+      e2 = fabs(c2[i] - node->min[i]);
+      if (e2 < fabs(c2[i] - node->max[i])) e2 = fabs(c2[i] - node->max[i]);
+      if (e2 < e) e = e2;
+    }
+    d += e*e;
+    if (d > r2) return 0;
+  }
+  return 1;
+}
+
+/* Finds points within r of c in a single pass over the tree.  For
+   periodic searches, c2[] is set as described above and leaf points use
+   minimum-image distances, with period[i] = 0 in dimensions that need no
+   wrapping; otherwise, c2 = c and period is all zeros.  Node tests are
+   padded by 1% so that round-off never drops a point. */
+#undef _fast3tree_find_sphere_periodic
+#define _fast3tree_find_sphere_periodic _F3TN(FAST3TREE_PREFIX,_fast3tree_find_sphere_periodic)
+void _fast3tree_find_sphere_periodic(struct fast3tree *t, struct tree3_node *n, struct fast3tree_results *res, const float c[FAST3TREE_DIM], const float c2[FAST3TREE_DIM], const float r, const float period[FAST3TREE_DIM], uint8_t *marks, const int do_marking) {
   int64_t i,j;
   float r2, dist, dx;
 
-  int64_t onlyone = (marked && (n->flags & FAST3TREE_MARKED)) ? 1 : 0;
+  int64_t onlyone = (marks && FAST3TREE_MARK_TST(marks, n - t->root)) ? 1 : 0;
 
-  if (_fast3tree_box_not_intersect_sphere(n,c2,r*1.01)) return;
-  if (_fast3tree_box_inside_sphere(n,c2,r*0.99)) { /* Entirely inside sphere */
-    if (do_marking) n->flags |= FAST3TREE_MARKED;
+  if (_fast3tree_box_not_intersect_sphere_periodic(n,c,c2,r*1.01)) return;
+  if (_fast3tree_box_inside_sphere_periodic(n,c,c2,r*0.99)) { /* Entirely inside sphere */
+    if (marks && do_marking) _fast3tree_set_mark(marks, n - t->root);
     _fast3tree_check_results_space(n,res);
     if (onlyone) {
       res->points[res->num_points++] = n->points;
@@ -478,7 +896,8 @@ void _fast3tree_find_sphere_offset(struct tree3_node *n, struct fast3tree_result
       j = dist = 0;
       float *pos = n->points[i].pos;
       for (; j<FAST3TREE_DIM; j++) {
-	dx = o[j] - fabs(c[j]-pos[j]);
+	dx = fabs(c[j]-pos[j]);
+	if (dx > 0.5f*period[j]) dx = period[j] - dx; //Sign flip if period is 0
 	dist += dx*dx;
       }
       if (dist < r2) {
@@ -490,73 +909,54 @@ void _fast3tree_find_sphere_offset(struct tree3_node *n, struct fast3tree_result
     return;
   }
   int64_t cur_points = res->num_points;
-  _fast3tree_find_sphere_offset(n->left, res, c, c2, o, r, marked, do_marking);
+  _fast3tree_find_sphere_periodic(t, n->left, res, c, c2, r, period, marks, do_marking);
   if (onlyone && (cur_points < res->num_points)) return;
-  _fast3tree_find_sphere_offset(n->right, res, c, c2, o, r, marked, do_marking);
+  _fast3tree_find_sphere_periodic(t, n->right, res, c, c2, r, period, marks, do_marking);
 }
 
-#undef _fast3tree_find_sphere_periodic_dim
-#define _fast3tree_find_sphere_periodic_dim _F3TN(FAST3TREE_PREFIX,_fast3tree_find_sphere_periodic_dim)
-void _fast3tree_find_sphere_periodic_dim(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], float c2[FAST3TREE_DIM], float o[FAST3TREE_DIM], float r, float dims[FAST3TREE_DIM], int dim, int marked, int do_marking) {
-  float c3[FAST3TREE_DIM];
-  if (dim<0) {
-    _fast3tree_find_sphere_offset(t->root, res, c, c2, o, r, marked, do_marking);
-    return;
-  }
-  memcpy(c3, c2, sizeof(float)*FAST3TREE_DIM);
-  o[dim]=0;
-  _fast3tree_find_sphere_periodic_dim(t, res, c, c3, o, r, dims, dim-1, marked, do_marking);
-  if (c[dim]+r > t->root->max[dim]) {
-    c3[dim] = c[dim]-dims[dim];
-    o[dim] = dims[dim];
-    _fast3tree_find_sphere_periodic_dim(t, res, c, c3, o, r, dims, dim-1, marked, do_marking);
-  }
-  if (c[dim]-r < t->root->min[dim]) {
-    c3[dim] = c[dim]+dims[dim];
-    o[dim] = dims[dim];
-    _fast3tree_find_sphere_periodic_dim(t, res, c, c3, o, r, dims, dim-1, marked, do_marking);
+#undef _fast3tree_periodic_images
+#define _fast3tree_periodic_images _F3TN(FAST3TREE_PREFIX,_fast3tree_periodic_images)
+static inline int _fast3tree_periodic_images(struct fast3tree *t, const float c[FAST3TREE_DIM], const float r, float c2[FAST3TREE_DIM], float period[FAST3TREE_DIM]) {
+  int i;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    c2[i] = c[i];
+    period[i] = 0;
+    if (r*2.0 > t->root->max[i] - t->root->min[i]) return 0; //Avoid wraparound intersections.
+    if (c[i]+r > t->root->max[i]) c2[i] = c[i] - (t->root->max[i] - t->root->min[i]);
+    else if (c[i]-r < t->root->min[i]) c2[i] = c[i] + (t->root->max[i] - t->root->min[i]);
+    if (c2[i] != c[i]) period[i] = t->root->max[i] - t->root->min[i];
   }
+  return 1;
 }
 
 int fast3tree_find_sphere_periodic(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], float r) {
-  float dims[FAST3TREE_DIM], o[FAST3TREE_DIM];
-  int i;
+  float c2[FAST3TREE_DIM], period[FAST3TREE_DIM];
   
   if (_fast3tree_sphere_inside_box(t->root, c, r)) {
     fast3tree_find_sphere(t, res, c, r);
     return 2;
   }
 
-  for (i=0; i<FAST3TREE_DIM; i++) {
-    dims[i] = t->root->max[i] - t->root->min[i];
-    o[i] = 0;
-    if (r*2.0 > dims[i]) return 0; //Avoid wraparound intersections.
-  }
-
   res->num_points = 0;
-  _fast3tree_find_sphere_periodic_dim(t, res, c, c, o, r, dims, FAST3TREE_DIM-1, 0, 0);
+  if (!t->num_points) return 1;
+  if (!_fast3tree_periodic_images(t, c, r, c2, period)) return 0;
+  _fast3tree_find_sphere_periodic(t, t->root, res, c, c2, r, period, NULL, 0);
   return 1;
 }
 
 
-int fast3tree_find_sphere_marked(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], float r, int periodic, int do_marking) {
-  float dims[FAST3TREE_DIM], o[FAST3TREE_DIM] = {0};
-  int i;
+int fast3tree_find_sphere_marked(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM], float r, int periodic, int do_marking, uint8_t *marks) {
+  float c2[FAST3TREE_DIM], period[FAST3TREE_DIM] = {0};
   
   res->num_points = 0;
   if (!t->num_points) return 1;
   if (!periodic || _fast3tree_sphere_inside_box(t->root, c, r)) {
-     _fast3tree_find_sphere_offset(t->root, res, c, c, o, r, 1, do_marking);
+    _fast3tree_find_sphere_periodic(t, t->root, res, c, c, r, period, marks, do_marking);
     return 2;
   }
 
-  for (i=0; i<FAST3TREE_DIM; i++) {
-    dims[i] = t->root->max[i] - t->root->min[i];
-    o[i] = 0;
-    if (r*2.0 > dims[i]) return 0; //Avoid wraparound intersections.
-  }
-
-  _fast3tree_find_sphere_periodic_dim(t, res, c, c, o, r, dims, FAST3TREE_DIM-1, 1, do_marking);
+  if (!_fast3tree_periodic_images(t, c, r, c2, period)) return 0;
+  _fast3tree_find_sphere_periodic(t, t->root, res, c, c2, r, period, marks, do_marking);
   return 1;
 }
 
@@ -689,19 +1089,29 @@ static inline int64_t _fast3tree_sort_dim_pos(struct tree3_node * node,
 
 #undef _fast3tree_find_minmax
 #define _fast3tree_find_minmax _F3TN(FAST3TREE_PREFIX,_fast3tree_find_minmax)
-static inline void _fast3tree_find_minmax(struct tree3_node *node) {
+#undef _fast3tree_minmax
+#define _fast3tree_minmax _F3TN(FAST3TREE_PREFIX,_fast3tree_minmax)
+/* Branch-free, with min and max kept in registers, so that the compiler can
+   use (vector) min/max instructions. */
+static inline void _fast3tree_minmax(FAST3TREE_TYPE *p, int64_t n,
+				     float *min, float *max) {
   int64_t i, j;
-  float x;
-  FAST3TREE_TYPE * p = node->points;
-  assert(node->num_points > 0);
-  for (j=0; j<FAST3TREE_DIM; j++) node->min[j] = node->max[j] = p[0].pos[j];
-  for (i=1; i<node->num_points; i++)  {
+  float x, mn[FAST3TREE_DIM], mx[FAST3TREE_DIM];
+  for (j=0; j<FAST3TREE_DIM; j++) mn[j] = mx[j] = p[0].pos[j];
+  for (i=1; i<n; i++)  {
     for (j=0; j<FAST3TREE_DIM; j++) {
       x = p[i].pos[j];
-      if (x<node->min[j]) node->min[j] = x;
-      else if (x>node->max[j]) node->max[j] = x;
+      mn[j] = (x < mn[j]) ? x : mn[j];
+      mx[j] = (x > mx[j]) ? x : mx[j];
     }
   }
+  memcpy(min, mn, sizeof(float)*FAST3TREE_DIM);
+  memcpy(max, mx, sizeof(float)*FAST3TREE_DIM);
+}
+
+static inline void _fast3tree_find_minmax(struct tree3_node *node) {
+  assert(node->num_points > 0);
+  _fast3tree_minmax(node->points, node->num_points, node->min, node->max);
 }
 
 #undef _fast3tree_split_node
@@ -768,6 +1178,187 @@ void _fast3tree_rebuild_pointers(struct fast3tree *t) {
   }
 }
 
+/* Large trees are built in two stages.  First, nodes with more than
+   FAST3TREE_TASK_POINTS points are split one level at a time; the nodes in
+   each level are partitioned in parallel, and their children are then
+   added in order.  Second, the remaining subtrees are built in parallel
+   into separate node arrays, which are then appended to the tree.  Points
+   end up in the same order as with the serial build, and the node layout
+   does not depend on the number of threads. */
+#define FAST3TREE_TASK_POINTS 65536
+
+#undef fast3tree_split
+#define fast3tree_split _F3TN(FAST3TREE_PREFIX,fast3tree_split)
+struct fast3tree_split {
+  int64_t node, num_left;
+  float min[2][FAST3TREE_DIM], max[2][FAST3TREE_DIM];
+};
+
+#undef fast3tree_build_info
+#define fast3tree_build_info _F3TN(FAST3TREE_PREFIX,fast3tree_build_info)
+struct fast3tree_build_info {
+  struct fast3tree *t, *subs;
+  struct fast3tree_split *splits;
+  int64_t *tasks;
+  int64_t num_splits, num_tasks, next;
+};
+
+#undef _fast3tree_split_thread
+#define _fast3tree_split_thread _F3TN(FAST3TREE_PREFIX,_fast3tree_split_thread)
+void *_fast3tree_split_thread(void *data) {
+  struct fast3tree_build_info *bi = data;
+  struct fast3tree_split *s;
+  struct tree3_node *n;
+  int64_t i;
+  while ((i = __sync_fetch_and_add(&bi->next, 1)) < bi->num_splits) {
+    s = bi->splits + i;
+    n = bi->t->root + s->node;
+    s->num_left = _fast3tree_sort_dim_pos(n, 1.0);
+    if (s->num_left == n->num_points || s->num_left == 0) continue;
+    _fast3tree_minmax(n->points, s->num_left, s->min[0], s->max[0]);
+    _fast3tree_minmax(n->points + s->num_left, n->num_points - s->num_left,
+		      s->min[1], s->max[1]);
+  }
+  return NULL;
+}
+
+#undef _fast3tree_subtree_thread
+#define _fast3tree_subtree_thread _F3TN(FAST3TREE_PREFIX,_fast3tree_subtree_thread)
+void *_fast3tree_subtree_thread(void *data) {
+  struct fast3tree_build_info *bi = data;
+  struct fast3tree *s;
+  struct tree3_node *n;
+  int64_t i;
+  while ((i = __sync_fetch_and_add(&bi->next, 1)) < bi->num_tasks) {
+    s = bi->subs + i;
+    n = bi->t->root + bi->tasks[i];
+    memset(s, 0, sizeof(struct fast3tree));
+    s->points = n->points;
+    s->num_points = n->num_points;
+    s->allocated_nodes = (3+n->num_points/(POINTS_PER_LEAF/2));
+    s->root = _fast3tree_check_realloc(NULL, sizeof(struct tree3_node)*(s->allocated_nodes), "Tree nodes");
+    s->root[0] = *n;
+    s->num_nodes = 1;
+    _fast3tree_split_node(s, s->root);
+  }
+  return NULL;
+}
+
+#undef _fast3tree_run_threads
+#define _fast3tree_run_threads _F3TN(FAST3TREE_PREFIX,_fast3tree_run_threads)
+void _fast3tree_run_threads(int64_t num_threads, int64_t num_tasks,
+			    void *(*func)(void *), void *data) {
+  int64_t i;
+  pthread_t *threads = NULL;
+  if (num_threads > num_tasks) num_threads = num_tasks;
+  if (num_threads < 2) { func(data); return; }
+  threads = _fast3tree_check_realloc(NULL, sizeof(pthread_t)*num_threads, "Tree threads");
+  for (i=1; i<num_threads; i++) {
+    if (pthread_create(threads+i, NULL, func, data)) {
+      fprintf(stderr, "[Error] Failed to create tree thread!\n");
+      exit(1);
+    }
+  }
+  func(data);
+  for (i=1; i<num_threads; i++) pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+#undef _fast3tree_build_parallel
+#define _fast3tree_build_parallel _F3TN(FAST3TREE_PREFIX,_fast3tree_build_parallel)
+void _fast3tree_build_parallel(struct fast3tree *t) {
+  struct fast3tree_build_info bi = {0};
+  struct fast3tree_split *sp;
+  struct fast3tree *s;
+  struct tree3_node *null_ptr = NULL, *n, *c;
+  int64_t i, j, k, base, ti, num_next, alloced_splits = 1, alloced_tasks = 0;
+
+  bi.t = t;
+  bi.splits = _fast3tree_check_realloc(NULL, sizeof(struct fast3tree_split), "Tree splits");
+  bi.splits[0].node = 0;
+  bi.num_splits = 1;
+  while (bi.num_splits) {
+    bi.next = 0;
+    _fast3tree_run_threads(t->num_threads, bi.num_splits, _fast3tree_split_thread, &bi);
+    if (t->num_nodes + 2*bi.num_splits > t->allocated_nodes) {
+      t->allocated_nodes = t->allocated_nodes*1.05 + 2*bi.num_splits + 1000;
+      t->root = _fast3tree_check_realloc(t->root, sizeof(struct tree3_node)*(t->allocated_nodes), "Tree nodes");
+    }
+    if (bi.num_tasks + 2*bi.num_splits > alloced_tasks) {
+      alloced_tasks = bi.num_tasks + 2*bi.num_splits + 1000;
+      bi.tasks = _fast3tree_check_realloc(bi.tasks, sizeof(int64_t)*alloced_tasks, "Tree tasks");
+    }
+    //Children of split j are stored as splits[num_splits+...] until the
+    //level is done, so make room for two per split.
+    if (3*bi.num_splits > alloced_splits) {
+      alloced_splits = 3*bi.num_splits + 1000;
+      bi.splits = _fast3tree_check_realloc(bi.splits, sizeof(struct fast3tree_split)*alloced_splits, "Tree splits");
+    }
+    num_next = 0;
+    for (i=0; i<bi.num_splits; i++) {
+      sp = bi.splits + i;
+      n = t->root + sp->node;
+      if (sp->num_left == n->num_points || sp->num_left == 0) {
+	n->div_dim = -1;
+	continue;
+      }
+      n->left = null_ptr + t->num_nodes;
+      n->right = null_ptr + (t->num_nodes + 1);
+      for (k=0; k<2; k++) {
+	c = t->root + t->num_nodes;
+	memset(c, 0, sizeof(struct tree3_node));
+	c->parent = null_ptr + sp->node;
+	c->num_points = k ? (n->num_points - sp->num_left) : sp->num_left;
+	c->points = n->points + (k ? sp->num_left : 0);
+	c->div_dim = -1;
+	memcpy(c->min, sp->min[k], sizeof(float)*FAST3TREE_DIM);
+	memcpy(c->max, sp->max[k], sizeof(float)*FAST3TREE_DIM);
+	if (c->num_points > FAST3TREE_TASK_POINTS)
+	  bi.splits[bi.num_splits + (num_next++)].node = t->num_nodes;
+	else if (c->num_points > POINTS_PER_LEAF)
+	  bi.tasks[bi.num_tasks++] = t->num_nodes;
+	t->num_nodes++;
+      }
+    }
+    memmove(bi.splits, bi.splits + bi.num_splits, sizeof(struct fast3tree_split)*num_next);
+    bi.num_splits = num_next;
+  }
+  free(bi.splits);
+
+  bi.subs = _fast3tree_check_realloc(NULL, sizeof(struct fast3tree)*bi.num_tasks, "Subtrees");
+  bi.next = 0;
+  _fast3tree_run_threads(t->num_threads, bi.num_tasks, _fast3tree_subtree_thread, &bi);
+  for (i=0, j=t->num_nodes; i<bi.num_tasks; i++) j += bi.subs[i].num_nodes - 1;
+  if (j > t->allocated_nodes) {
+    t->allocated_nodes = j;
+    t->root = _fast3tree_check_realloc(t->root, sizeof(struct tree3_node)*(t->allocated_nodes), "Tree nodes");
+  }
+
+  //Subtree node 0 is the existing task node; other nodes are appended.
+  for (i=0; i<bi.num_tasks; i++) {
+    s = bi.subs + i;
+    ti = bi.tasks[i];
+    base = t->num_nodes - 1;
+#define SUBTREE_INDEX(x) (((x) == null_ptr) ? ti : base + ((x) - null_ptr))
+    for (j=0; j<s->num_nodes; j++) {
+      n = j ? t->root + base + j : t->root + ti;
+      if (j) {
+	*n = s->root[j];
+	n->parent = null_ptr + SUBTREE_INDEX(n->parent);
+      }
+      else n->div_dim = s->root[0].div_dim;
+      if (n->div_dim < 0) continue;
+      n->left = null_ptr + SUBTREE_INDEX(s->root[j].left);
+      n->right = null_ptr + SUBTREE_INDEX(s->root[j].right);
+    }
+#undef SUBTREE_INDEX
+    t->num_nodes += s->num_nodes - 1;
+    free(s->root);
+  }
+  free(bi.subs);
+  free(bi.tasks);
+}
+
 #undef _fast3tree_build
 #define _fast3tree_build _F3TN(FAST3TREE_PREFIX,_fast3tree_build)
 void _fast3tree_build(struct fast3tree *t) {
@@ -799,12 +1390,137 @@ void _fast3tree_build(struct fast3tree *t) {
   for (j=0; j<FAST3TREE_DIM; j++) assert(isfinite(root->min[j]));
   for (j=0; j<FAST3TREE_DIM; j++) assert(isfinite(root->max[j]));
 
-  if (root->num_points > POINTS_PER_LEAF)
+  if (root->num_points > FAST3TREE_TASK_POINTS)
+    _fast3tree_build_parallel(t);
+  else if (root->num_points > POINTS_PER_LEAF)
     _fast3tree_split_node(t, root);
 
   t->root = _fast3tree_check_realloc(t->root, sizeof(struct tree3_node)*(t->num_nodes), "Tree nodes");
   t->allocated_nodes = t->num_nodes;
   _fast3tree_rebuild_pointers(t);
+  _fast3tree_build_compact(t);
+}
+
+/* Refitting.  Leaves are identified by the offset of their first point in
+   the parent, so that leaves[] is non-decreasing exactly when the points
+   are in parent order.  Since every node's left child comes before its
+   right child in the point list, the points for each parent node form a
+   contiguous range, which is split at the first point belonging to the
+   right child.  Parent nodes with points on only one side are skipped, so
+   a refit tree with L leaves has 2L-1 nodes. */
+#define FAST3TREE_REFIT_MIN_FILL 0.25
+
+void fast3tree_find_leaves(struct fast3tree *parent, int64_t n, FAST3TREE_TYPE *p, int64_t *leaves) {
+  int64_t i, j;
+  struct tree3_node *nd;
+  for (i=0; i<n; i++) {
+    leaves[i] = -1;
+    if (!parent->num_points) continue;
+    for (j=0; j<FAST3TREE_DIM; j++) if (!isfinite(p[i].pos[j])) break;
+    if (j<FAST3TREE_DIM) continue;
+    for (nd = parent->root; nd->div_dim >= 0; )
+      nd = (p[i].pos[nd->div_dim] <= nd->left->max[nd->div_dim]) ? nd->left : nd->right;
+    leaves[i] = nd->points - parent->points;
+  }
+}
+
+#undef _fast3tree_refit_node
+#define _fast3tree_refit_node _F3TN(FAST3TREE_PREFIX,_fast3tree_refit_node)
+struct tree3_node *_fast3tree_refit_node(struct fast3tree *t, struct fast3tree *parent, struct tree3_node *pn, int64_t a, int64_t b, const int64_t *leaves, struct tree3_node *up) {
+  int64_t i, lo=a, hi=b, m, split;
+  struct tree3_node *n;
+  while (pn->div_dim >= 0) {
+    split = pn->right->points - parent->points;
+    for (lo=a, hi=b; lo<hi; ) {
+      m = lo + (hi-lo)/2;
+      if (leaves[m] < split) lo = m+1;
+      else hi = m;
+    }
+    if (lo == a) pn = pn->right;
+    else if (lo == b) pn = pn->left;
+    else break;
+  }
+
+  n = t->root + t->num_nodes;
+  t->num_nodes++;
+  memset(n, 0, sizeof(struct tree3_node));
+  n->parent = up ? up : n;
+  n->points = t->points + a;
+  n->num_points = b - a;
+  n->div_dim = pn->div_dim;
+  if (n->div_dim < 0) {
+    _fast3tree_find_minmax(n);
+    return n;
+  }
+  n->left = _fast3tree_refit_node(t, parent, pn->left, a, lo, leaves, n);
+  n->right = _fast3tree_refit_node(t, parent, pn->right, lo, b, leaves, n);
+  memcpy(n->min, n->left->min, sizeof(float)*FAST3TREE_DIM);
+  memcpy(n->max, n->right->max, sizeof(float)*FAST3TREE_DIM);
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    if (n->min[i] > n->right->min[i]) n->min[i] = n->right->min[i];
+    if (n->max[i] < n->left->max[i]) n->max[i] = n->left->max[i];
+  }
+  return n;
+}
+
+int fast3tree_refit(struct fast3tree *t, struct fast3tree *parent, int64_t n, FAST3TREE_TYPE *p, const int64_t *leaves) {
+  int64_t i, j, num_leaves = 0;
+  if (n < 1) return 0;
+  for (i=0; i<n; i++) {
+    if (leaves[i] < 0 || (i && leaves[i] < leaves[i-1])) return 0;
+    if (!i || leaves[i] != leaves[i-1]) num_leaves++;
+    for (j=0; j<FAST3TREE_DIM; j++) if (!isfinite(p[i].pos[j])) return 0;
+  }
+  if (n < num_leaves*POINTS_PER_LEAF*FAST3TREE_REFIT_MIN_FILL) return 0;
+
+  t->points = p;
+  t->num_points = n;
+  t->allocated_nodes = 2*num_leaves - 1;
+  t->root = _fast3tree_check_realloc(t->root, sizeof(struct tree3_node)*(t->allocated_nodes), "Tree nodes");
+  t->num_nodes = 0;
+  _fast3tree_refit_node(t, parent, parent->root, 0, n, leaves, NULL);
+  assert(t->num_nodes == t->allocated_nodes);
+  _fast3tree_build_compact(t);
+  return 1;
+}
+#undef FAST3TREE_REFIT_MIN_FILL
+
+#ifdef FAST3TREE_COMPACT
+#undef _fast3tree_compact_node
+#define _fast3tree_compact_node _F3TN(FAST3TREE_PREFIX,_fast3tree_compact_node)
+void _fast3tree_compact_node(struct fast3tree *t, struct tree3_node *n, int64_t parent) {
+  int64_t i = t->num_cnodes;
+  struct tree3_cnode *cn = t->cnodes + i;
+  t->num_cnodes++;
+  memcpy(cn->min, n->min, sizeof(float)*FAST3TREE_DIM);
+  memcpy(cn->max, n->max, sizeof(float)*FAST3TREE_DIM);
+  cn->offset = n->points - t->points;
+  cn->num_points = n->num_points;
+  cn->div_dim = n->div_dim;
+  t->cparent[i] = parent;
+  if (n->div_dim > -1) {
+    _fast3tree_compact_node(t, n->left, i);
+    _fast3tree_compact_node(t, n->right, i);
+  }
+  t->cnodes[i].skip = t->num_cnodes;
+}
+#endif /* FAST3TREE_COMPACT */
+
+//Nothing is stored for trees too large for 32-bit indices.
+void _fast3tree_build_compact(struct fast3tree *t) {
+#ifdef FAST3TREE_COMPACT
+  int64_t i, j;
+  t->num_cnodes = 0;
+  if (!t->num_nodes || t->num_points >= INT32_MAX || t->num_nodes >= INT32_MAX)
+    return;
+  t->cnodes = _fast3tree_check_realloc(t->cnodes, sizeof(struct tree3_cnode)*t->num_nodes, "Compact tree nodes");
+  t->cparent = _fast3tree_check_realloc(t->cparent, sizeof(int32_t)*t->num_nodes, "Compact tree parents");
+  t->cpos = _fast3tree_check_realloc(t->cpos, sizeof(float)*FAST3TREE_DIM*t->num_points, "Compact tree positions");
+  for (i=0; i<t->num_points; i++)
+    for (j=0; j<FAST3TREE_DIM; j++)
+      t->cpos[j*t->num_points + i] = t->points[i].pos[j];
+  _fast3tree_compact_node(t, t->root, -1);
+#endif /* FAST3TREE_COMPACT */
 }
 
 #undef _fast3tree_maxmin_rebuild
@@ -846,6 +1562,7 @@ void _fast3tree_set_minmax(struct fast3tree *t, float min, float max) {
     t->root->min[i] = min;
     t->root->max[i] = max;
   }
+  _fast3tree_build_compact(t);
 }
 
 
@@ -880,13 +1597,72 @@ float _fast3tree_find_next_closest_dist(const struct tree3_node *n, const float
 }
 
 
+#ifdef FAST3TREE_COMPACT
+#undef _fast3tree_find_next_closest_cdist
+#define _fast3tree_find_next_closest_cdist _F3TN(FAST3TREE_PREFIX,_fast3tree_find_next_closest_cdist)
+float _fast3tree_find_next_closest_cdist(const struct fast3tree *t, int64_t i, const float c[FAST3TREE_DIM], float r, int64_t o_i, int64_t *counts) {
+  int64_t i1,i2;
+  const struct tree3_cnode *n = t->cnodes + i;
+
+  if (_fast3tree_cbox_not_intersect_sphere(n,c,r) || (o_i==i)) return r;
+  if (n->div_dim < 0) { /* Leaf node */
+    *counts = (*counts)+1;
+    return sqrt(_fast3tree_leaf_min_dist(t, n, c, r*r));
+  }
+  i1 = i+1;
+  i2 = t->cnodes[i1].skip;
+  if (c[n->div_dim] > 0.5*(n->min[n->div_dim]+n->max[n->div_dim])) {
+    i1 = i2;
+    i2 = i+1;
+  }
+  r = _fast3tree_find_next_closest_cdist(t, i1, c, r, o_i, counts);
+  return _fast3tree_find_next_closest_cdist(t, i2, c, r, o_i, counts);
+}
+
+#undef _fast3tree_find_next_closest_distance_compact
+#define _fast3tree_find_next_closest_distance_compact _F3TN(FAST3TREE_PREFIX,_fast3tree_find_next_closest_distance_compact)
+float _fast3tree_find_next_closest_distance_compact(struct fast3tree *t, float c[FAST3TREE_DIM]) {
+  int64_t i=0, k, j, counts = 0;
+  float dist = 0, dx, min_dist = 0, *pos;
+  const struct tree3_cnode *nodes = t->cnodes, *nd;
+
+  while (nodes[i].div_dim >= 0) {
+    if (c[nodes[i].div_dim] <= nodes[i+1].max[nodes[i].div_dim]) i++;
+    else i = nodes[i+1].skip;
+  }
+
+  while (i && (nodes[i].min[nodes[t->cparent[i]].div_dim] ==
+	       nodes[i].max[nodes[t->cparent[i]].div_dim])) i = t->cparent[i];
+  nd = nodes + i;
+
+  for (j=0; j<FAST3TREE_DIM; j++) {
+    dx = nd->max[j]-nd->min[j];
+    min_dist += dx*dx;
+  }
+
+  for (k=0; k<nd->num_points; k++) {
+    dist = 0;
+    pos = t->points[nd->offset+k].pos;
+    for (j=0; j<FAST3TREE_DIM; j++) {
+      dx = c[j] - pos[j];
+      dist += dx*dx;
+    }
+    if (dist && (dist < min_dist)) min_dist = dist;
+  }
+  return _fast3tree_find_next_closest_cdist(t, 0, c, sqrt(min_dist), i, &counts);
+}
+#endif /* FAST3TREE_COMPACT */
+
 #undef fast3tree_find_next_closest_distance
 #define fast3tree_find_next_closest_distance _F3TN(FAST3TREE_PREFIX,fast3tree_find_next_closest_distance)
 float fast3tree_find_next_closest_distance(struct fast3tree *t, struct fast3tree_results *res, float c[FAST3TREE_DIM]) {
   int64_t i=0, j;
   float dist = 0, dx, min_dist = 0;
   struct tree3_node *nd = t->root;
-  
+
+#ifdef FAST3TREE_COMPACT
+  if (t->num_cnodes) return _fast3tree_find_next_closest_distance_compact(t, c);
+#endif /* FAST3TREE_COMPACT */
   while (nd->div_dim >= 0) {
     if (c[nd->div_dim] <= (nd->left->max[nd->div_dim])) { nd = nd->left; }
     else { nd = nd->right; }
@@ -913,6 +1689,361 @@ float fast3tree_find_next_closest_distance(struct fast3tree *t, struct fast3tree
   return min_dist;
 }
 
+
+/* k-nearest-neighbor distances.  Squared distances of the k nearest points
+   found so far are kept in a bounded max-heap.  Since the points of any
+   node's sibling lie beyond the node's bounds in the parent's split
+   dimension, the upward walk can stop as soon as the ball around the query
+   point (of radius the k-th nearest distance) fits inside the current
+   node.  All comparisons use squared distances computed the same way as
+   the leaf distances, so results match a brute-force search exactly. */
+#define FAST3TREE_KNN_CHUNK 256
+#define FAST3TREE_KNN_BUFFER 64
+
+struct fast3tree_knn_info {
+  struct fast3tree *t;
+  const int64_t *q;
+  int64_t num_q, k, next;
+  float *dists;
+};
+
+struct fast3tree_knn_heap {
+  float *d;
+  int64_t num, k;
+};
+
+#undef _fast3tree_knn_push
+#define _fast3tree_knn_push _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_push)
+static inline void _fast3tree_knn_push(struct fast3tree_knn_heap *h, float d) {
+  int64_t i, c;
+  if (!(d > 0)) return;
+  if (h->num < h->k) {
+    for (i=h->num++; i && h->d[(i-1)/2] < d; i=(i-1)/2)
+      h->d[i] = h->d[(i-1)/2];
+    h->d[i] = d;
+    return;
+  }
+  if (d >= h->d[0]) return;
+  for (i=0; (c=2*i+1) < h->num; i=c) {
+    if (c+1 < h->num && h->d[c+1] > h->d[c]) c++;
+    if (h->d[c] <= d) break;
+    h->d[i] = h->d[c];
+  }
+  h->d[i] = d;
+}
+
+#undef _fast3tree_knn_box_outside
+#define _fast3tree_knn_box_outside _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_box_outside)
+static inline int _fast3tree_knn_box_outside(const float *min, const float *max, const float c[FAST3TREE_DIM], const struct fast3tree_knn_heap *h) {
+  int64_t i;
+  float d = 0, e;
+  if (h->num < h->k) return 0;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    if ((e = c[i]-min[i])<0) d+=e*e;
+    else if ((e = c[i]-max[i])>0) d+=e*e;
+  }
+  return (d >= h->d[0]);
+}
+
+//Whether all points outside the box are at least as far as the k-th nearest.
+#undef _fast3tree_knn_ball_inside
+#define _fast3tree_knn_ball_inside _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_ball_inside)
+static inline int _fast3tree_knn_ball_inside(const float *min, const float *max, const float c[FAST3TREE_DIM], const struct fast3tree_knn_heap *h) {
+  int64_t i;
+  float e;
+  if (h->num < h->k) return 0;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    e = c[i]-min[i];
+    if (e*e < h->d[0]) return 0;
+    e = max[i]-c[i];
+    if (e*e < h->d[0]) return 0;
+  }
+  return 1;
+}
+
+#undef _fast3tree_knn_leaf
+#define _fast3tree_knn_leaf _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_leaf)
+void _fast3tree_knn_leaf(const struct fast3tree *t, int64_t offset, int64_t num_points, const float c[FAST3TREE_DIM], struct fast3tree_knn_heap *h) {
+  int64_t i, j, k, num;
+  float d[FAST3TREE_KNN_BUFFER], dx;
+  for (i=0; i<num_points; i+=FAST3TREE_KNN_BUFFER) {
+    num = num_points - i;
+    if (num > FAST3TREE_KNN_BUFFER) num = FAST3TREE_KNN_BUFFER;
+#ifdef FAST3TREE_COMPACT
+    if (t->num_cnodes) {
+      _fast3tree_leaf_dists(t, offset+i, num, c, d);
+      for (k=0; k<num; k++) _fast3tree_knn_push(h, d[k]);
+      continue;
+    }
+#endif /* FAST3TREE_COMPACT */
+    for (k=0; k<num; k++) {
+      d[k] = 0;
+      for (j=0; j<FAST3TREE_DIM; j++) {
+	dx = c[j]-t->points[offset+i+k].pos[j];
+	d[k] += dx*dx;
+      }
+      _fast3tree_knn_push(h, d[k]);
+    }
+  }
+}
+
+#undef _fast3tree_knn_search
+#define _fast3tree_knn_search _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_search)
+void _fast3tree_knn_search(const struct fast3tree *t, const struct tree3_node *n, const float c[FAST3TREE_DIM], struct fast3tree_knn_heap *h) {
+  const struct tree3_node *n1, *n2;
+  if (_fast3tree_knn_box_outside(n->min, n->max, c, h)) return;
+  if (n->div_dim < 0) {
+    _fast3tree_knn_leaf(t, n->points - t->points, n->num_points, c, h);
+    return;
+  }
+  n1 = n->left; n2 = n->right;
+  if (c[n->div_dim] > 0.5*(n->min[n->div_dim]+n->max[n->div_dim])) {
+    n1 = n->right;
+    n2 = n->left;
+  }
+  _fast3tree_knn_search(t, n1, c, h);
+  _fast3tree_knn_search(t, n2, c, h);
+}
+
+#undef _fast3tree_knn_point
+#define _fast3tree_knn_point _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_point)
+void _fast3tree_knn_point(const struct fast3tree *t, FAST3TREE_TYPE *p, struct fast3tree_knn_heap *h) {
+  const struct tree3_node *n, *prev;
+  for (n = t->root; n->div_dim >= 0; )
+    n = (p < n->right->points) ? n->left : n->right;
+  _fast3tree_knn_leaf(t, n->points - t->points, n->num_points, p->pos, h);
+  for (prev = n; prev != t->root; prev = n) {
+    if (_fast3tree_knn_ball_inside(prev->min, prev->max, p->pos, h)) return;
+    n = prev->parent;
+    _fast3tree_knn_search(t, (n->left == prev) ? n->right : n->left, p->pos, h);
+  }
+}
+
+#ifdef FAST3TREE_COMPACT
+#undef _fast3tree_knn_csearch
+#define _fast3tree_knn_csearch _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_csearch)
+void _fast3tree_knn_csearch(const struct fast3tree *t, int64_t i, const float c[FAST3TREE_DIM], struct fast3tree_knn_heap *h) {
+  int64_t i1, i2;
+  const struct tree3_cnode *n = t->cnodes + i;
+  if (_fast3tree_knn_box_outside(n->min, n->max, c, h)) return;
+  if (n->div_dim < 0) {
+    _fast3tree_knn_leaf(t, n->offset, n->num_points, c, h);
+    return;
+  }
+  i1 = i+1;
+  i2 = t->cnodes[i1].skip;
+  if (c[n->div_dim] > 0.5*(n->min[n->div_dim]+n->max[n->div_dim])) {
+    i1 = i2;
+    i2 = i+1;
+  }
+  _fast3tree_knn_csearch(t, i1, c, h);
+  _fast3tree_knn_csearch(t, i2, c, h);
+}
+
+#undef _fast3tree_knn_cpoint
+#define _fast3tree_knn_cpoint _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_cpoint)
+void _fast3tree_knn_cpoint(const struct fast3tree *t, int64_t pi, struct fast3tree_knn_heap *h) {
+  int64_t i=0, parent;
+  const struct tree3_cnode *nodes = t->cnodes;
+  const float *c = t->points[pi].pos;
+  while (nodes[i].div_dim >= 0)
+    i = (pi < nodes[nodes[i+1].skip].offset) ? i+1 : nodes[i+1].skip;
+  _fast3tree_knn_leaf(t, nodes[i].offset, nodes[i].num_points, c, h);
+  for (; i; i = parent) {
+    if (_fast3tree_knn_ball_inside(nodes[i].min, nodes[i].max, c, h)) return;
+    parent = t->cparent[i];
+    _fast3tree_knn_csearch(t, (i == parent+1) ? nodes[i].skip : parent+1, c, h);
+  }
+}
+#endif /* FAST3TREE_COMPACT */
+
+#undef _fast3tree_knn_thread
+#define _fast3tree_knn_thread _F3TN(FAST3TREE_PREFIX,_fast3tree_knn_thread)
+void *_fast3tree_knn_thread(void *data) {
+  struct fast3tree_knn_info *ki = data;
+  struct fast3tree *t = ki->t;
+  struct fast3tree_knn_heap h;
+  int64_t i, pi, start, end;
+  h.k = ki->k;
+  h.d = _fast3tree_check_realloc(NULL, sizeof(float)*h.k, "k-NN heap");
+  while ((start = __sync_fetch_and_add(&ki->next, 1)*FAST3TREE_KNN_CHUNK) < ki->num_q) {
+    end = start + FAST3TREE_KNN_CHUNK;
+    if (end > ki->num_q) end = ki->num_q;
+    for (i=start; i<end; i++) {
+      pi = ki->q ? ki->q[i] : i;
+      h.num = 0;
+#ifdef FAST3TREE_COMPACT
+      if (t->num_cnodes) _fast3tree_knn_cpoint(t, pi, &h);
+      else
+#endif /* FAST3TREE_COMPACT */
+	_fast3tree_knn_point(t, t->points + pi, &h);
+      ki->dists[i] = h.num ? sqrt(h.d[0]) : 0;
+    }
+  }
+  free(h.d);
+  return NULL;
+}
+
+void fast3tree_find_knn_distances(struct fast3tree *t, int64_t num_q, const int64_t *q, int64_t k, float *dists) {
+  struct fast3tree_knn_info ki = {t, q, num_q, k, 0, dists};
+  if (num_q < 1) return;
+  if (k < 1 || !t->num_points) {
+    memset(dists, 0, sizeof(float)*num_q);
+    return;
+  }
+  _fast3tree_run_threads(t->num_threads,
+			 (num_q + FAST3TREE_KNN_CHUNK - 1)/FAST3TREE_KNN_CHUNK,
+			 _fast3tree_knn_thread, &ki);
+}
+#undef FAST3TREE_KNN_CHUNK
+#undef FAST3TREE_KNN_BUFFER
+
+
+/* Dual-tree pair linking.  Node pairs farther apart than r are skipped;
+   if all points in a pair of nodes (or in one node) are within r of each
+   other, they are linked to the first point in a single pass; otherwise,
+   the node with more points is split, down to leaf-leaf distance checks.
+   Each unordered pair of nodes is visited at most once.  For threading,
+   node pairs with more than FAST3TREE_TASK_POINTS points between them are
+   expanded serially, and the remaining pairs are run as separate tasks. */
+#define FAST3TREE_LINK_BUFFER 64
+
+struct fast3tree_link_info {
+  struct fast3tree *t;
+  float r, r2;
+  void (*link)(void *data, int64_t i, int64_t j);
+  void *data;
+  struct tree3_node **tasks;
+  int64_t num_tasks, alloced_tasks, next, collect;
+};
+
+//Smallest and largest squared distances between points in boxes a and b.
+#undef _fast3tree_box_box_dist2
+#define _fast3tree_box_box_dist2 _F3TN(FAST3TREE_PREFIX,_fast3tree_box_box_dist2)
+static inline void _fast3tree_box_box_dist2(const struct tree3_node *a, const struct tree3_node *b, float *min_d2, float *max_d2) {
+  int64_t i;
+  float e, f;
+  *min_d2 = *max_d2 = 0;
+  for (i=0; i<FAST3TREE_DIM; i++) {
+    if ((e = b->min[i]-a->max[i]) > 0) *min_d2 += e*e;
+    else if ((e = a->min[i]-b->max[i]) > 0) *min_d2 += e*e;
+    e = a->max[i]-b->min[i];
+    f = b->max[i]-a->min[i];
+    if (f > e) e = f;
+    *max_d2 += e*e;
+  }
+}
+
+#undef _fast3tree_link_all
+#define _fast3tree_link_all _F3TN(FAST3TREE_PREFIX,_fast3tree_link_all)
+static inline void _fast3tree_link_all(struct fast3tree_link_info *li, const struct tree3_node *a, const struct tree3_node *b) {
+  int64_t i, first = a->points - li->t->points;
+  for (i=1; i<a->num_points; i++) li->link(li->data, first, first+i);
+  if (!b) return;
+  for (i=0; i<b->num_points; i++)
+    li->link(li->data, first, (b->points - li->t->points) + i);
+}
+
+//Links points in leaves a and b (or within leaf a, if b == a).
+#undef _fast3tree_link_leaves
+#define _fast3tree_link_leaves _F3TN(FAST3TREE_PREFIX,_fast3tree_link_leaves)
+void _fast3tree_link_leaves(struct fast3tree_link_info *li, const struct tree3_node *a, const struct tree3_node *b) {
+  const struct fast3tree *t = li->t;
+  const int64_t a_off = a->points - t->points, b_off = b->points - t->points;
+  int64_t i, j, k, m, num;
+  float d[FAST3TREE_LINK_BUFFER], dx, *c;
+  for (i=0; i<a->num_points; i++) {
+    c = a->points[i].pos;
+    if (a!=b && _fast3tree_box_not_intersect_sphere(b, c, li->r)) continue;
+    for (j=(a==b) ? i+1 : 0; j<b->num_points; j+=FAST3TREE_LINK_BUFFER) {
+      num = b->num_points - j;
+      if (num > FAST3TREE_LINK_BUFFER) num = FAST3TREE_LINK_BUFFER;
+#ifdef FAST3TREE_COMPACT
+      if (t->num_cnodes) _fast3tree_leaf_dists(t, b_off+j, num, c, d);
+      else
+#endif /* FAST3TREE_COMPACT */
+      for (k=0; k<num; k++) {
+	d[k] = 0;
+	for (m=0; m<FAST3TREE_DIM; m++) {
+	  dx = c[m]-b->points[j+k].pos[m];
+	  d[k] += dx*dx;
+	}
+      }
+      for (k=0; k<num; k++)
+	if (d[k] < li->r2) li->link(li->data, a_off+i, b_off+j+k);
+    }
+  }
+}
+
+#undef _fast3tree_link_nodes
+#define _fast3tree_link_nodes _F3TN(FAST3TREE_PREFIX,_fast3tree_link_nodes)
+void _fast3tree_link_nodes(struct fast3tree_link_info *li, struct tree3_node *a, struct tree3_node *b) {
+  float min_d2, max_d2;
+  struct tree3_node *tmp;
+  if (li->collect && a->num_points + b->num_points <= FAST3TREE_TASK_POINTS) {
+    if (li->num_tasks >= li->alloced_tasks) {
+      li->alloced_tasks = li->alloced_tasks*2 + 1000;
+      li->tasks = _fast3tree_check_realloc(li->tasks, sizeof(struct tree3_node *)*2*li->alloced_tasks, "Tree link tasks");
+    }
+    li->tasks[2*li->num_tasks] = a;
+    li->tasks[2*li->num_tasks+1] = b;
+    li->num_tasks++;
+    return;
+  }
+
+  _fast3tree_box_box_dist2(a, b, &min_d2, &max_d2);
+  if (min_d2 >= li->r2) return;
+  if (max_d2 < li->r2) {
+    _fast3tree_link_all(li, a, (a==b) ? NULL : b);
+    return;
+  }
+  if (a == b) {
+    if (a->div_dim < 0) _fast3tree_link_leaves(li, a, a);
+    else {
+      _fast3tree_link_nodes(li, a->left, a->left);
+      _fast3tree_link_nodes(li, a->right, a->right);
+      _fast3tree_link_nodes(li, a->left, a->right);
+    }
+    return;
+  }
+  if (a->div_dim < 0 && b->div_dim < 0) {
+    _fast3tree_link_leaves(li, a, b);
+    return;
+  }
+  if (a->div_dim < 0 || (b->div_dim >= 0 && b->num_points > a->num_points)) {
+    tmp = a; a = b; b = tmp;
+  }
+  _fast3tree_link_nodes(li, a->left, b);
+  _fast3tree_link_nodes(li, a->right, b);
+}
+
+#undef _fast3tree_link_thread
+#define _fast3tree_link_thread _F3TN(FAST3TREE_PREFIX,_fast3tree_link_thread)
+void *_fast3tree_link_thread(void *data) {
+  struct fast3tree_link_info *li = data;
+  int64_t i;
+  while ((i = __sync_fetch_and_add(&li->next, 1)) < li->num_tasks)
+    _fast3tree_link_nodes(li, li->tasks[2*i], li->tasks[2*i+1]);
+  return NULL;
+}
+
+void fast3tree_link_pairs(struct fast3tree *t, float r, void (*link)(void *data, int64_t i, int64_t j), void *data) {
+  struct fast3tree_link_info li = {0};
+  if (t->num_points < 2 || !(r > 0)) return;
+  li.t = t;
+  li.r = r;
+  li.r2 = r*r;
+  li.link = link;
+  li.data = data;
+  li.collect = (t->num_threads > 1);
+  _fast3tree_link_nodes(&li, t->root, t->root);
+  if (!li.collect) return;
+  li.collect = 0;
+  _fast3tree_run_threads(t->num_threads, li.num_tasks, _fast3tree_link_thread, &li);
+  free(li.tasks);
+}
+#undef FAST3TREE_LINK_BUFFER
+
 #undef float
 
 #endif /* _FAST3TREE_C_ */
@@ -6,15 +6,28 @@
 #include "fof.h"
 #include "particle.h"
 #include "config_vars.h"
+#include "union_find.h"
+#include "radix_sort.h"
 
-struct fof *fofs = NULL;
-struct smallfof *smallfofs = NULL;
-int64_t num_fofs=0, num_alloced_fofs = 0, 
+__thread struct fof *fofs = NULL;
+__thread struct smallfof *smallfofs = NULL;
+__thread int64_t num_fofs=0, num_alloced_fofs = 0, 
   num_smallfofs = 0, num_alloced_smallfofs = 0;
-struct particle *root_p = 0;
-int64_t *particle_smallfofs = NULL;
-int64_t num_particles = 0, num_alloced_particles = 0;
-int64_t num_boundary_fofs = 0;
+__thread struct particle *root_p = 0;
+__thread int64_t *particle_smallfofs = NULL;
+__thread int64_t num_particles = 0, num_alloced_particles = 0;
+__thread int64_t num_boundary_fofs = 0;
+__thread struct union_find particle_links = {0};
+__thread int64_t particle_links_pending = 0;
+
+//Sorts smaller than SORT_INSERTION_MAX particles are done with an
+//insertion sort; sorts larger than SORT_GATHER_MAX are permuted in place
+//rather than gathered through a scratch buffer.
+#define SORT_INSERTION_MAX 64
+#define SORT_GATHER_MAX 1000000
+__thread int64_t *sort_perm = NULL, *sort_keys = NULL;
+__thread struct particle *sort_buffer = NULL;
+__thread int64_t num_alloced_sort_buffer = 0;
 
 void init_particle_smallfofs(int64_t num_p, struct particle *particles) {
   int64_t i;
@@ -25,11 +38,32 @@ void init_particle_smallfofs(int64_t num_p, struct particle *particles) {
     num_alloced_particles = num_p;
   }
   for (i=0; i<num_p; i++) particle_smallfofs[i] = -1;
+  uf_init(&particle_links, num_p);
+  particle_links_pending = 0;
   root_p = particles;
   num_particles = num_p;
   num_boundary_fofs = num_fofs = num_smallfofs = 0;
 }
 
+//Turns the particle links into smallfofs, numbered in order of each
+//group's first particle (so the labels do not depend on linking order).
+void _label_particle_links(void) {
+  int64_t i, n = uf_label_sets(&particle_links, particle_smallfofs);
+  particle_links_pending = 0;
+  if (n > num_alloced_smallfofs) {
+    num_alloced_smallfofs = n + 1000;
+    check_realloc_s(smallfofs, sizeof(struct smallfof), num_alloced_smallfofs);
+  }
+  for (i=0; i<n; i++) smallfofs[i].root = i;
+  num_smallfofs = n;
+}
+
+//Returns the particle union-find, for linking particles directly.
+struct union_find *get_particle_links(void) {
+  particle_links_pending = 1;
+  return &particle_links;
+}
+
 int64_t add_new_smallfof(void) {
   if (num_smallfofs >= num_alloced_smallfofs) {
     smallfofs = (struct smallfof *)
@@ -69,6 +103,7 @@ void merge_smallfofs(struct smallfof *f1, struct smallfof *f2) {
 }
 
 int64_t tag_boundary_particle(struct particle *p) {
+  if (particle_links_pending) _label_particle_links();
   int64_t f = SMALLFOF_OF(p);
   if (f<0) {
     SMALLFOF_OF(p) = add_new_smallfof();
@@ -86,35 +121,15 @@ int64_t tag_boundary_particle(struct particle *p) {
 
 
 void link_particle_to_fof(struct particle *p, int64_t n, struct particle **links) {
-  int64_t i;
-  int64_t f = SMALLFOF_OF(p);
+  int64_t i, f = p - root_p;
   if (n<2) return;
-  if (f<0) {
-    for (i=0; i<n; i++) {
-      if (SMALLFOF_OF(links[i]) == -1) continue;
-      else { f = SMALLFOF_OF(links[i]); break; }
-    }
-    if (f<0) { f = add_new_smallfof(); }
-  }
-  for (i=0; i<n; i++) {
-    if (SMALLFOF_OF(links[i]) == -1) SMALLFOF_OF(links[i]) = f;
-    else merge_smallfofs(smallfofs + SMALLFOF_OF(links[i]), smallfofs + f);
-  }
-}
-
-void link_fof_to_fof(struct particle *p, int64_t n, struct particle **links) {
-  int64_t i;
-  int64_t f = SMALLFOF_OF(p);
-  if ((n<2) || (f<0)) return;
-  for (i=0; i<n; i++) {
-    if (SMALLFOF_OF(links[i]) == -1) continue;
-    if (SMALLFOF_OF(links[i]) == f) continue;
-    merge_smallfofs(smallfofs + SMALLFOF_OF(links[i]), smallfofs + f);
-  }
+  for (i=0; i<n; i++) uf_union(&particle_links, f, links[i] - root_p);
+  particle_links_pending = 1;
 }
 
 void collapse_smallfofs(void) {
   int64_t i;
+  if (particle_links_pending) _label_particle_links();
   for (i=0; i<num_smallfofs; i++) _collapse_smallfof(smallfofs + i);
   for (i=0; i<num_particles; i++) {
     if (particle_smallfofs[i] < 0) continue;
@@ -160,10 +175,98 @@ void partition_sort_particles(int64_t min, int64_t max,
   partition_sort_particles(si, max, particles, assignments);
 }
 
+//Stable insertion sort, for sorts smaller than SORT_INSERTION_MAX.
+void _insertion_sort_particles(struct particle *particles, int64_t *keys,
+			       int64_t n) {
+  int64_t i, j, key;
+  struct particle tmp_p;
+  for (i=1; i<n; i++) {
+    if (keys[i-1] <= keys[i]) continue;
+    key = keys[i];
+    tmp_p = particles[i];
+    for (j=i; j>0 && keys[j-1] > key; j--) {
+      keys[j] = keys[j-1];
+      particles[j] = particles[j-1];
+    }
+    keys[j] = key;
+    particles[j] = tmp_p;
+  }
+}
+
+//Applies perm[] (so that element i receives element perm[i]) in place
+//by following each cycle of the permutation; perm[] is overwritten with
+//the identity.
+void _permute_particles_in_place(struct particle *particles, int64_t *keys,
+				 int64_t *perm, int64_t n) {
+  int64_t i, j, next, tmp;
+  struct particle tmp_p;
+  for (i=0; i<n; i++) {
+    if (perm[i] == i) continue;
+    tmp_p = particles[i];
+    tmp = keys[i];
+    for (j=i; perm[j] != i; j=next) {
+      next = perm[j];
+      particles[j] = particles[next];
+      keys[j] = keys[next];
+      perm[j] = j;
+    }
+    particles[j] = tmp_p;
+    keys[j] = tmp;
+    perm[j] = j;
+  }
+}
+
+//Sorts particles[] and keys[] by key; the sort is stable.  The order is
+//found by sorting indices (rather than full particles).  For up to
+//SORT_GATHER_MAX particles, the particles are then moved only once, by
+//gathering into a scratch buffer; larger sorts (where the extra memory
+//could be a problem) apply the permutation in place instead.
+void sort_particles_by_key(struct particle *particles, int64_t *keys,
+			   int64_t n) {
+  int64_t i, min_key, max_key;
+  if (n < SORT_INSERTION_MAX) {
+    _insertion_sort_particles(particles, keys, n);
+    return;
+  }
+  min_key = max_key = keys[0];
+  for (i=1; i<n; i++) {
+    if (keys[i] < min_key) min_key = keys[i];
+    if (keys[i] > max_key) max_key = keys[i];
+  }
+  if (min_key == max_key) return;
+
+  if (n > num_alloced_sort_buffer) {
+    check_realloc_s(sort_perm, sizeof(int64_t), n);
+    if (n <= SORT_GATHER_MAX) {
+      check_realloc_s(sort_keys, sizeof(int64_t), n);
+      check_realloc_s(sort_buffer, sizeof(struct particle), n);
+      num_alloced_sort_buffer = n;
+    }
+  }
+  sort_indices_by_key(keys, n, sort_perm, NUM_THREADS);
+  if (n > SORT_GATHER_MAX) {
+    _permute_particles_in_place(particles, keys, sort_perm, n);
+    return;
+  }
+  for (i=0; i<n; i++) {
+    sort_keys[i] = keys[sort_perm[i]];
+    sort_buffer[i] = particles[sort_perm[i]];
+  }
+  memcpy(keys, sort_keys, sizeof(int64_t)*n);
+  memcpy(particles, sort_buffer, sizeof(struct particle)*n);
+}
+
+void free_particle_sort_buffers(void) {
+  check_realloc_s(sort_perm, 0, 0);
+  check_realloc_s(sort_keys, 0, 0);
+  check_realloc_s(sort_buffer, 0, 0);
+  num_alloced_sort_buffer = 0;
+}
+
 void build_fullfofs(void) {
   int64_t i, sf=-1, last_sf=-1, f=-1;
   collapse_smallfofs();
-  partition_sort_particles(0, num_particles, root_p, particle_smallfofs);
+  sort_particles_by_key(root_p, particle_smallfofs, num_particles);
   for (i=0; i<num_particles; i++) {
     if (particle_smallfofs[i] < 0) continue;
     sf = particle_smallfofs[i];
@@ -189,6 +292,7 @@ struct fof *return_fullfofs(int64_t *num_f, int64_t *num_bf) {
   smallfofs = check_realloc(smallfofs, 0, "Freeing SmallFOFs.");
   particle_smallfofs = check_realloc(particle_smallfofs, 0,
 				     "Freeing particle smallfofs.");
+  uf_free(&particle_links);
   num_alloced_particles = 0;
   f_all_fofs = fofs;
   *num_f = num_fofs;
@@ -201,11 +305,8 @@ struct fof *return_fullfofs(int64_t *num_f, int64_t *num_bf) {
 
 void copy_fullfofs(struct fof **base, int64_t *num_f, int64_t *num_alloced_f)
 {
-  if ((*num_f)+num_fofs > (*num_alloced_f)) {
-    *base = check_realloc(*base, sizeof(struct fof)*((*num_f)+num_fofs+1000),
-			  "Allocating copy space for FOFs.");
-    *num_alloced_f = (*num_f)+num_fofs+1000;
-  }
+  check_realloc_smart(*base, sizeof(struct fof), *num_alloced_f,
+		      (*num_f)+num_fofs);
   memcpy((*base)+(*num_f), fofs, sizeof(struct fof)*num_fofs);
   *num_f = (*num_f) + num_fofs;
 
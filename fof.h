@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "particle.h"
+#include "union_find.h"
 
 struct fof {
   int64_t num_p;
@@ -13,14 +14,14 @@ struct smallfof {
   int64_t root;
 };
 
-extern struct particle *root_p;
-extern int64_t *particle_smallfofs;
-extern struct smallfof *smallfofs;
+extern __thread struct particle *root_p;
+extern __thread int64_t *particle_smallfofs;
+extern __thread struct smallfof *smallfofs;
 #define SMALLFOF_OF(a) particle_smallfofs[(a) - root_p]
 
 void init_particle_smallfofs(int64_t num_p, struct particle *particles);
 void link_particle_to_fof(struct particle *p, int64_t n, struct particle **links);
-void link_fof_to_fof(struct particle *p, int64_t n, struct particle **links);
+struct union_find *get_particle_links(void);
 int64_t tag_boundary_particle(struct particle *p);
 
 void build_fullfofs(void);
@@ -29,6 +30,9 @@ void copy_fullfofs(struct fof **base, int64_t *num_f, int64_t *num_alloced_f);
 
 void partition_sort_particles(int64_t min, int64_t max,
 			      struct particle *particles, int64_t *assignments);
+void sort_particles_by_key(struct particle *particles, int64_t *keys,
+			   int64_t n);
+void free_particle_sort_buffers(void);
 int64_t add_new_smallfof(void);
 void merge_smallfofs(struct smallfof *f1, struct smallfof *f2);
 void _collapse_smallfof(struct smallfof *f);
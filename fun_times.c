@@ -23,7 +23,7 @@ int64_t prev_snap = -1;
 int64_t num_prev_halos = 0;
 struct halo *prev_halo_buffer = NULL;
 struct fast3tree *phtree = NULL;
-struct fast3tree_results *phtree_res = NULL;
+__thread struct fast3tree_results *phtree_res = NULL; //Per thread; phtree is shared
 void **prev_files = NULL;
 int64_t *prev_file_lengths = NULL;
 int64_t *prev_chunks = NULL;
@@ -68,6 +68,11 @@ void clear_prev_files(void) {
   num_prev_halos = 0;
 }
 
+void free_prev_halo_results(void) {
+  if (phtree_res) fast3tree_results_free(phtree_res);
+  phtree_res = NULL;
+}
+
 void load_prev_binary_halos(int64_t snap, int64_t chunk, float *bounds, int64_t our_chunk) {
   void *input;
   char buffer[1024];
@@ -110,10 +115,7 @@ void load_previous_halos(int64_t snap, int64_t chunk, float *bounds) {
   struct binary_output_header bh;
   float overlap_region[6];
 
-  if (!phtree) {
-    phtree = fast3tree_init(num_prev_halos, ph);
-    phtree_res = fast3tree_results_init();
-  }
+  if (!phtree) phtree = fast3tree_init(num_prev_halos, ph);
   if (snap == STARTING_SNAP || LIGHTCONE || !PARALLEL_IO) return;
   check_realloc_s(prev_halo_buffer,sizeof(struct halo),PREV_HALO_BUFFER_SIZE);
   if (prev_snap != (snap-1)) {
@@ -189,6 +191,7 @@ void reassign_particles_to_parent(struct halo *h, struct particle *hp, int64_t *
   struct previous_halo *tph=NULL;
   struct inthash *ih = NULL;
   if (prev_id < 0) return;
+  if (!phtree_res) phtree_res = fast3tree_results_init();
   fast3tree_find_sphere(phtree, phtree_res, parent_h->pos, parent_h->r);
   if (!phtree_res->num_points) return;
   for (i=0; i<phtree_res->num_points; i++) {
@@ -200,6 +203,7 @@ void reassign_particles_to_parent(struct halo *h, struct particle *hp, int64_t *
   if (!tph) return;
 
   ih = new_inthash();
+  ih_prealloc(ih, tph->num_p);
   mlock(tph->particles, tph->num_p*sizeof(int64_t));
   for (i=0; i<tph->num_p; i++)
     ih_setval(ih, tph->particles[i], (void *)1);
@@ -220,6 +224,7 @@ float find_previous_mass(struct halo *h, struct particle *hp, int64_t *best_num_
 
   *best_num_p = 0;
   if (h->num_p < 100 || !num_prev_halos) return 0;
+  if (!phtree_res) phtree_res = fast3tree_results_init();
   fast3tree_find_sphere(phtree, phtree_res, h->pos, h->r);
   if (!phtree_res->num_points) return 0;
   for (i=0; i<phtree_res->num_points; i++) {
@@ -238,6 +243,7 @@ float find_previous_mass(struct halo *h, struct particle *hp, int64_t *best_num_
   max_particles = h->num_p;
 
   ih = new_inthash();
+  ih_prealloc(ih, max_particles);
   for (i=0; i<max_particles; i++)
     ih_setval(ih, p[hp[i].id].id, (void *)1);
 
@@ -25,6 +25,7 @@ void load_previous_halos(int64_t snap, int64_t chunk, float *bounds);
 void convert_and_sort_core_particles(struct halo *h, struct particle *hp, float max_r, int64_t *n_core);
 float find_previous_mass(struct halo *h, struct particle *hp, int64_t *best_num_p, float max_r);
 void clear_prev_files(void);
+void free_prev_halo_results(void);
 void reassign_particles_to_parent(struct halo *h, struct particle *hp, int64_t *particle_halos, struct halo *parent_h);
 
 #endif /* _FUN_TIMES_H_ */
@@ -19,35 +19,58 @@
 #include "fun_times.h"
 #include "jacobi.h"
 #include "hubble.h"
+#include "threads.h"
+#include "radix_sort.h"
+#include "arena.h"
 
 #define FAST3TREE_DIM 6
 #define POINTS_PER_LEAF 40
 #define FAST3TREE_PREFIX GROUPIES
+#define FAST3TREE_COMPACT
 #define FAST3TREE_TYPE struct particle
 #define FAST3TREE_EXTRA_INFO float ll, density;
 #include "fast3tree.c"
 
-struct particle *copies = NULL; //For storing phase-space FOFs
-int64_t *particle_halos = NULL;
-float *particle_r = NULL;
-struct potential *po = NULL;
-int64_t num_alloc_pc = 0, num_copies = 0;
+__thread struct particle *copies = NULL; //For storing phase-space FOFs
+__thread int64_t *particle_halos = NULL;
+__thread float *particle_r = NULL;
+__thread struct potential *po = NULL;
+__thread int64_t num_alloc_pc = 0, num_copies = 0, num_alloc_po = 0;
 
-struct fof *subfofs = NULL;
-int64_t num_subfofs = 0, num_alloced_subfofs = 0;
+__thread struct fof *subfofs = NULL;
+__thread int64_t num_subfofs = 0, num_alloced_subfofs = 0;
 
-int64_t num_halos = 0;
-struct halo *halos = NULL;
-struct extra_halo_info *extra_info = NULL;
+__thread int64_t num_halos = 0;
+__thread struct halo *halos = NULL;
+__thread struct extra_halo_info *extra_info = NULL;
 
-struct fast3tree_results *res = NULL;
-struct fast3tree *phasetree = NULL;
+__thread struct fast3tree_results *res = NULL;
+__thread struct fast3tree *phasetree = NULL; //Tree for the current level
+//Phase-space trees are kept for each level, so that subFOFs can be refit
+//from their parent FOF's tree if REFIT_SUBFOF_TREES is set (see
+//_find_subfofs_better2()).
+__thread struct fast3tree **level_trees = NULL;
+__thread int64_t num_level_trees = 0, level_tree_threads = 0;
+__thread int64_t *particle_leaves = NULL;
+__thread int64_t *leaf_groups = NULL; //For stellar subFOFs
 
-int64_t num_alloc_gh = 0, num_growing_halos = 0;
-struct halo **growing_halos = NULL;
+//Scratch space for the current FOF; released in LIFO order by each
+//user, and reset after each top-level FOF in find_subs().
+__thread struct arena scratch;
 
-int64_t *halo_ids = NULL;
-int64_t num_alloced_halo_ids = 0;
+__thread int64_t num_alloc_gh = 0, num_growing_halos = 0;
+__thread struct halo **growing_halos = NULL;
+
+__thread int64_t *halo_ids = NULL;
+__thread int64_t num_alloced_halo_ids = 0;
+
+//Changed whenever particles move between halos, so that cached halo
+//moments (see calc_basic_halo_props()) are recalculated.
+__thread int64_t halo_moments_version = 0;
+
+//Per-thread random state, reset for each FOF so that the results do not
+//depend on which thread (or in which order) FOFs are processed.
+__thread unsigned int rand_seed = 1;
 
 double particle_thresh_dens[5] = {0}, particle_rvir_dens = 0,
   particle_rvir_dens_z0 = 0;
@@ -124,6 +147,7 @@ void add_new_halo(void) {
       extra_info[i].child = extra_info[i].next_cochild = 
 	extra_info[i].ph = extra_info[i].prev_cochild = extra_info[i].sub_of = -1;
       extra_info[i].max_metric = 0;
+      extra_info[i].moments.version = -1;
       halos[i].flags |= GROWING_FLAG;
     }
   }
@@ -151,9 +175,40 @@ int dist_compare(const void *a, const void *b) {
   return 0;
 }
 
+//Sorts pot[0..n-1] by increasing r2, as qsort() with dist_compare() would,
+//but stably and with a radix sort on the bits of r2 (which, as r2 is
+//non-negative, sort in the same order as the floats themselves).
+#define RADII_MIN_RADIX_SORT 256
+void sort_potentials_by_radius(struct potential *pot, int64_t n) {
+  int64_t i, *keys, *perm;
+  struct potential *sorted;
+  struct arena_mark mark;
+  union { float f; int32_t i; } r2;
+  if (n < RADII_MIN_RADIX_SORT) {
+    qsort(pot, n, sizeof(struct potential), dist_compare);
+    return;
+  }
+  mark = arena_mark(&scratch);
+  arena_alloc_s(&scratch, keys, sizeof(int64_t), n);
+  arena_alloc_s(&scratch, perm, sizeof(int64_t), n);
+  arena_alloc_s(&scratch, sorted, sizeof(struct potential), n);
+  for (i=0; i<n; i++) {
+    r2.f = pot[i].r2;
+    keys[i] = r2.i;
+  }
+  sort_indices_by_key(keys, n, perm, 1);
+  for (i=0; i<n; i++) sorted[i] = pot[perm[i]];
+  memcpy(pot, sorted, sizeof(struct potential)*n);
+  arena_release(&scratch, mark);
+}
+
 void _reset_potentials(struct halo *base_h, struct halo *h, float *cen, int64_t p_start, int64_t level, int64_t potential_only) {
   int64_t j, k;
   float dx, r2;
+  if (p_start + h->num_p > num_alloc_po) {
+    num_alloc_po = p_start + h->num_p + 1000;
+    check_realloc_s(po, sizeof(struct potential), num_alloc_po);
+  }
   memset(po + p_start, 0, sizeof(struct potential)*h->num_p);
   for (j=0; j<h->num_p; j++) {
     r2 = 0;
@@ -170,9 +225,142 @@ void _reset_potentials(struct halo *base_h, struct halo *h, float *cen, int64_t
   }
 }
 
+/* Nested-interval layout: once a FOF's halos are final, its particles are
+   reordered so that each halo's own particles are followed by those of
+   its subhalos (depth-first, in child-list order, as calc_particle_radii()
+   visits them).  nested_order[] lists the halos in that order, and a
+   halo's substructure is nested_order[nested_pos[h]+1..nested_end[h]-1],
+   so its particles can be gathered in a single sweep.  Arrays are indexed
+   by h-nested_h_start, and come from the scratch arena (released by
+   find_subs() once halo properties are done); num_nested_halos is 0 if
+   there is no layout. */
+__thread int64_t *nested_order = NULL, *nested_pos = NULL, *nested_end = NULL;
+__thread int64_t nested_h_start = 0, num_nested_halos = 0;
+
+//Returns 0 if the hierarchy below h has a loop.
+int64_t _visit_nested_halos(int64_t h, int64_t *next) {
+  int64_t child, i = h - nested_h_start;
+  if (nested_pos[i] > -1) return 0;
+  nested_pos[i] = *next;
+  nested_order[(*next)++] = h;
+  for (child = extra_info[h].child; child > -1;
+       child = extra_info[child].next_cochild)
+    if (!_visit_nested_halos(child, next)) return 0;
+  nested_end[i] = *next;
+  return 1;
+}
+
+void order_nested_halos(int64_t h_start) {
+  int64_t i, j, next = 0, total_p = 0;
+  struct particle *sorted;
+  struct arena_mark mark;
+  num_nested_halos = 0;
+  nested_h_start = h_start;
+  if (num_halos <= h_start) return;
+  arena_alloc_s(&scratch, nested_order, sizeof(int64_t), num_halos-h_start);
+  arena_alloc_s(&scratch, nested_pos, sizeof(int64_t), num_halos-h_start);
+  arena_alloc_s(&scratch, nested_end, sizeof(int64_t), num_halos-h_start);
+  for (i=h_start; i<num_halos; i++) {
+    nested_pos[i-h_start] = -1;
+    total_p += halos[i].num_p;
+  }
+  if (total_p != num_copies) return; //Not every particle is in one halo
+  for (i=h_start; i<num_halos; i++) {
+    if (extra_info[i].sub_of > -1) continue;
+    if (!_visit_nested_halos(i, &next)) return;
+  }
+  if (next < num_halos-h_start) return; //Unreachable halos
+
+  mark = arena_mark(&scratch);
+  arena_alloc_s(&scratch, sorted, sizeof(struct particle), num_copies);
+  for (i=0, total_p=0; i<next; i++) {
+    j = nested_order[i];
+    memcpy(sorted+total_p, copies+halos[j].p_start,
+	   sizeof(struct particle)*halos[j].num_p);
+    halos[j].p_start = total_p;
+    total_p += halos[j].num_p;
+  }
+  memcpy(copies, sorted, sizeof(struct particle)*num_copies);
+  arena_release(&scratch, mark);
+  num_nested_halos = next;
+}
+
+//Same as _reset_potentials() (without the flags), for the particles
+//copies[c_start, c_end).
+void _reset_potential_range(float *cen, int64_t c_start, int64_t c_end,
+			    int64_t p_start, int64_t potential_only) {
+  int64_t j, k, n = c_end - c_start;
+  float dx, r2;
+  struct particle *cp = copies + c_start;
+  struct potential *pp;
+  if (n < 1) return;
+  if (p_start + n > num_alloc_po) {
+    num_alloc_po = p_start + n + 1000;
+    check_realloc_s(po, sizeof(struct potential), num_alloc_po);
+  }
+  pp = po + p_start;
+  memset(pp, 0, sizeof(struct potential)*n);
+  for (j=0; j<n; j++) {
+    r2 = 0;
+    for (k=0; k<3; k++) { dx=cp[j].pos[k] - cen[k]; r2+=dx*dx; }
+    pp[j].r2 = r2;
+    memcpy(pp[j].pos, cp[j].pos, sizeof(float)*6);
+    pp[j].mass = cp[j].mass;
+    pp[j].energy = cp[j].energy;
+    pp[j].type = cp[j].type;
+    if (potential_only) pp[j].ke = -1;
+  }
+}
+
+//Gathers the particles of h and its substructure (except for that of
+//skip, if not NULL) from the nested layout, where they are contiguous:
+//radii are found in one sweep over the range (or two, around skip), and
+//flags are then set halo by halo.
+int64_t _gather_nested_halos(struct halo *base_h, struct halo *h,
+			     struct halo *skip, float *cen, int64_t p_start,
+			     int64_t potential_only) {
+  int64_t i, j, k, offset, first = nested_pos[h-halos-nested_h_start],
+    last = nested_end[h-halos-nested_h_start];
+  int64_t c_start = h->p_start, c_end, s_start, s_end;
+  struct halo *lh = halos + nested_order[last-1];
+  c_end = s_start = s_end = lh->p_start + lh->num_p;
+  if (skip) {
+    s_start = skip->p_start;
+    lh = halos + nested_order[nested_end[skip-halos-nested_h_start]-1];
+    s_end = lh->p_start + lh->num_p;
+  }
+  _reset_potential_range(cen, c_start, s_start, p_start, potential_only);
+  _reset_potential_range(cen, s_end, c_end, p_start + (s_start - c_start),
+			 potential_only);
+  for (i=first; i<last; i++) {
+    j = nested_order[i];
+    if (skip && j == skip-halos) {
+      i = nested_end[skip-halos-nested_h_start]-1;
+      continue;
+    }
+    offset = p_start + halos[j].p_start - c_start;
+    if (halos[j].p_start >= s_end) offset -= s_end - s_start;
+    if (halos+j == base_h)
+      for (k=0; k<halos[j].num_p; k++) po[offset+k].flags = 1;
+    if (!potential_only && (halos[j].num_p < base_h->num_p*0.03))
+      for (k=0; k<halos[j].num_p; k++) po[offset+k].flags = 2;
+  }
+  return p_start + (c_end - c_start) - (s_end - s_start);
+}
+
 int64_t calc_particle_radii(struct halo *base_h, struct halo *h, float *cen, int64_t p_start, int64_t level, int64_t potential_only) {
   int64_t j, total_p = p_start, child, first_child, parent;
 
+  if (!level && num_nested_halos && h-halos >= nested_h_start &&
+      h-halos < nested_h_start+num_nested_halos) {
+    total_p = _gather_nested_halos(base_h, h, NULL, cen, p_start, potential_only);
+    parent = extra_info[h-halos].sub_of;
+    if ((h == base_h) && (parent > -1) &&
+	(halos[parent].num_child_particles*INCLUDE_HOST_POTENTIAL_RATIO < h->num_child_particles))
+      total_p = _gather_nested_halos(base_h, halos+parent, h, cen, total_p, 1);
+    return total_p;
+  }
+
   //Break accidental graph loops
   if (level >= num_alloced_halo_ids) add_more_halo_ids();
   halo_ids[level] = h-halos;
@@ -216,14 +404,12 @@ void link_particle_types(struct fof *f) {
   build_fullfofs();
 }
 
+//The phase-space tree holds f->particles, so tree indices are particle
+//indices for the particle links.
 void _find_subfofs_at_r(struct fof *f, float target_r) {
-  int64_t i;
   init_particle_smallfofs(f->num_p, f->particles);
-  
-  for (i=0; i<f->num_p; i++) {
-    fast3tree_find_sphere(phasetree, res, f->particles[i].pos, target_r); //*pow(f->particles[i].mass/PARTICLE_MASS, 1.0/6.0));
-    link_particle_to_fof(f->particles + i, res->num_points, res->points);
-  }
+  fast3tree_link_pairs(phasetree, target_r, uf_union_callback,
+		       get_particle_links());
   build_fullfofs();
 }
 
@@ -244,25 +430,41 @@ int64_t separate_dm(struct fof *f) {
 
 
 #define MAX_PARTICLES_TO_SAMPLE 10000
-void _find_subfofs_better2(struct fof *f,  float thresh) {
-  int64_t i, j, num_test = MAX_PARTICLES_TO_SAMPLE;
+/* The particles of a subFOF keep the order they had in the parent FOF's
+   tree (the sort in build_fullfofs() is stable), so the parent's tree
+   structure can be reused for the subFOF.  Refitting leaves the points in
+   parent order rather than in the order a rebuild would put them, so it
+   is only done if REFIT_SUBFOF_TREES is set.
+   Parent leaves must be found before the particles are renormalized; the
+   tree is fully rebuilt if refitting fails. */
+void _find_subfofs_better2(struct fof *f,  float thresh, struct fast3tree *parent) {
+  int64_t i, j, num_test = MAX_PARTICLES_TO_SAMPLE, *samples = NULL;
   float target_r = 0;
+  struct arena_mark mark = arena_mark(&scratch);
+  if (parent) fast3tree_find_leaves(parent, f->num_p, f->particles, particle_leaves + (f->particles - copies));
   norm_sd(f, thresh, NULL, NULL);
   //norm_sd_bary(f);
   int64_t num_dm = 0; //f->num_p;
   //int64_t num_dm = separate_dm(f);
   if (!num_dm) num_dm = f->num_p;
-  fast3tree_rebuild(phasetree, num_dm, f->particles);
+  if (!parent || !fast3tree_refit(phasetree, parent, num_dm, f->particles,
+				  particle_leaves + (f->particles - copies)))
+    fast3tree_rebuild(phasetree, num_dm, f->particles);
   if (EXACT_LL_CALC) num_test = num_dm;
   if (num_test > num_dm) num_test = num_dm;
-  else srand(f->num_p);
-
-  for (i=0; i<num_test; i++) {
-    if (num_test == num_dm) j = i;
-    else { j = rand(); j<<=31; j+=rand(); j%=(num_dm); }
-    particle_r[i] = fast3tree_find_next_closest_distance(phasetree, res, 
-							 f->particles[j].pos); //*pow(PARTICLE_MASS/f->particles[j].mass, 1.0/6.0);
+  //Seeded per subFOF, so results don't depend on the order of the search
+  rand_seed = f->num_p;
+
+  if (num_test < num_dm) {
+    arena_alloc_s(&scratch, samples, sizeof(int64_t), num_test);
+    for (i=0; i<num_test; i++) {
+      j = rand_r(&rand_seed); j<<=31; j+=rand_r(&rand_seed); j%=(num_dm);
+      samples[i] = j;
+    }
   }
+  //Sample indices are into f->particles, which is also the tree point list.
+  fast3tree_find_knn_distances(phasetree, num_test, samples, 1, particle_r);
+  arena_release(&scratch, mark);
   target_r = find_median_r(particle_r, num_test, thresh);
   if (num_dm < f->num_p) fast3tree_rebuild(phasetree, f->num_p, f->particles);
   _find_subfofs_at_r(f, target_r);
@@ -271,7 +473,9 @@ void _find_subfofs_better2(struct fof *f,  float thresh) {
 
 void reassign_halo_particles(int64_t p_start, int64_t p_end) {
   int64_t last_halo, j;
-  partition_sort_particles(p_start, p_end, copies, particle_halos);
+  halo_moments_version++;
+  sort_particles_by_key(copies + p_start, particle_halos + p_start,
+			p_end - p_start);
   last_halo = particle_halos[p_start];
   halos[last_halo].p_start = p_start;
   for (j=p_start + 1; j<p_end; j++) {
@@ -283,12 +487,15 @@ void reassign_halo_particles(int64_t p_start, int64_t p_end) {
   halos[last_halo].num_p = j - halos[last_halo].p_start;
 }
 
-int sort_by_ll(const void *a, const void *b) {
-  const int64_t *c = a;
-  const int64_t *d = b;
-  if (phasetree->root[*c].ll < phasetree->root[*d].ll) return -1;
-  if (phasetree->root[*c].ll > phasetree->root[*d].ll) return 1;
-  return 0;
+/* Phase-space linking length for a node: the 6D volume per particle, to
+   the 1/6 power.  Empty or flat nodes take their parent's value. */
+float _node_phase_space_ll(struct tree3_node *n) {
+  double v = 1.0;
+  int64_t j;
+  for (j=0; j<6; j++) v *= n->max[j]-n->min[j];
+  if (n->num_points && v>0) return pow(v/n->num_points, 1.0/6.0);
+  if (n->parent && n->parent != n) return _node_phase_space_ll(n->parent);
+  return 1e20;
 }
 
 
@@ -327,53 +534,141 @@ int64_t join_subfofs_if_needed(int64_t sf1, int64_t sf2, struct tree3_node *n, i
   return sf1;
 }
 
+/* Stellar subFOFs are found by linking leaves in order of increasing
+   linking length, so that denser regions form groups first.  Particles
+   are never unlinked, and groups only merge, so once all of a node's
+   particles are in the same group they stay that way; leaf_groups[]
+   records such nodes (or -1 for the rest). */
+struct star_link_info {
+  struct tree3_node *leaf;
+  float *c, r, r2;
+  int64_t sf, *gp;
+  float *lls;
+  struct tree3_node **rn;
+  FILE *distances;
+};
+
+//Root of the group shared by all particles in a node, or -1
+int64_t _node_star_group(struct tree3_node *n) {
+  int64_t g = leaf_groups[n - phasetree->root];
+  if (g < 0) return -1;
+  _collapse_smallfof(smallfofs+g);
+  return smallfofs[g].root;
+}
+
+void _update_star_groups(struct tree3_node *n) {
+  int64_t i, sf, g = -1;
+  struct tree3_node *sibling;
+  if (n->div_dim < 0) {
+    for (i=0; i<n->num_points; i++) {
+      sf = SMALLFOF_OF(n->points+i);
+      if (sf < 0) return;
+      _collapse_smallfof(smallfofs+sf);
+      sf = smallfofs[sf].root;
+      if (g < 0) g = sf;
+      else if (sf != g) return;
+    }
+  } else {
+    g = _node_star_group(n->left);
+    if (g < 0 || _node_star_group(n->right) != g) return;
+  }
+  leaf_groups[n - phasetree->root] = g;
+  for (; n->parent && n->parent != n; n = n->parent) {
+    sibling = (n->parent->left == n) ? n->parent->right : n->parent->left;
+    if (_node_star_group(sibling) != g) break;
+    leaf_groups[n->parent - phasetree->root] = g;
+  }
+}
+
+/* Links all particles within r of c to group sf, visiting them in the
+   same order as fast3tree_find_sphere() would return them.  Nodes whose
+   particles are all in group sf already are skipped, as linking them
+   would change nothing. */
+void _link_star_sphere(struct tree3_node *n, struct star_link_info *sl) {
+  int64_t i, j, sf2;
+  float dist, dx;
+  if (_fast3tree_box_not_intersect_sphere(n, sl->c, sl->r)) return;
+  if (_node_star_group(n) == sl->sf) return;
+  if (n->div_dim >= 0) {
+    _link_star_sphere(n->left, sl);
+    _link_star_sphere(n->right, sl);
+  } else {
+    for (i=0; i<n->num_points; i++) {
+      for (j=0, dist=0; j<FAST3TREE_DIM; j++) {
+	dx = sl->c[j] - n->points[i].pos[j];
+	dist += dx*dx;
+      }
+      if (!(dist < sl->r2)) continue;
+      sf2 = SMALLFOF_OF(n->points+i);
+      if (sf2 < 0) {
+	SMALLFOF_OF(n->points+i) = sl->sf;
+	sl->gp[sl->sf]++;
+      } else {
+	_collapse_smallfof(smallfofs+sf2);
+	sf2 = smallfofs[sf2].root;
+	sl->sf = join_subfofs_if_needed(sl->sf, sf2, sl->leaf, sl->gp, sl->lls,
+					sl->rn, sl->distances);
+      }
+    }
+  }
+  if (leaf_groups[n - phasetree->root] < 0) _update_star_groups(n);
+}
+
 void _find_subfofs_better3(struct fof *f) {
-  int64_t i, j, k;
+  int64_t i, j, num_leaf_nodes = 0;
+  uint32_t ll_bits;
+  struct star_link_info sl;
+  struct key_index *leaf_order;
+  struct arena_mark mark = arena_mark(&scratch);
   static int64_t sf_offset = 0;
   norm_sd_bary(f);
   //float v_scaling = sqrt(SCALE_NOW)*dynamical_time/NON_DM_METRIC_SCALING;
   fast3tree_rebuild(phasetree, f->num_p, f->particles);
+  arena_alloc_s(&scratch, leaf_order, sizeof(struct key_index), phasetree->num_nodes);
+  arena_alloc_s(&scratch, leaf_groups, sizeof(int64_t), phasetree->num_nodes);
+  //Only leaf linking lengths and densities are used
   for (i=0; i<phasetree->num_nodes; i++) {
     double v = 1.0;
     struct tree3_node *n = phasetree->root + i;
+    leaf_groups[i] = -1;
+    if (n->div_dim >= 0) continue;
     for (j=0; j<6; j++) v *= n->max[j]-n->min[j];
-    n->ll = 1e20;
+    n->ll = _node_phase_space_ll(n);
     n->density = 0;
-    if (n->num_points && v>0) n->ll = pow(v/n->num_points, 1.0/6.0);
-    else if (n->parent) n->ll = n->parent->ll;
     for (j=0; j<n->num_points; j++) n->density += n->points[j].mass;
     if (n->num_points && v>0) n->density /= v;
     else n->density = 0;
-  }
-
-  int64_t *process_order = NULL;
-  check_realloc_s(process_order, sizeof(int64_t), phasetree->num_nodes);
-  int64_t num_leaf_nodes = 0;
-  for (i=0; i<phasetree->num_nodes; i++) {
-    if (phasetree->root[i].div_dim >= 0) continue;
-    process_order[num_leaf_nodes] = i;
+    //Linking lengths are positive, so their bits sort in the same order
+    memcpy(&ll_bits, &n->ll, sizeof(float));
+    leaf_order[num_leaf_nodes].key = ll_bits;
+    leaf_order[num_leaf_nodes].index = i;
     num_leaf_nodes++;
   }
-  qsort(process_order, num_leaf_nodes, sizeof(int64_t), sort_by_ll);
+  radix_sort_key_index(leaf_order, num_leaf_nodes, 1);
   init_particle_smallfofs(f->num_p, f->particles);
 
-  float *lls = NULL;
-  check_realloc_s(lls, sizeof(float), num_leaf_nodes);
-  int64_t *gp = NULL;
-  check_realloc_s(gp, sizeof(int64_t), num_leaf_nodes);
-  struct tree3_node **rn = NULL;
-  check_realloc_s(rn, sizeof(struct tree3_node *), num_leaf_nodes);
+  float *lls;
+  int64_t *gp;
+  struct tree3_node **rn;
+  arena_alloc_s(&scratch, lls, sizeof(float), phasetree->num_nodes);
+  arena_alloc_s(&scratch, gp, sizeof(int64_t), phasetree->num_nodes);
+  arena_alloc_s(&scratch, rn, sizeof(struct tree3_node *), phasetree->num_nodes);
   FILE *distances = NULL;
   if (OUTPUT_LEVELS) {
     distances = check_fopen("fof_distances.txt", "a");
     fprintf(distances, "#FOF1 NP1 FOF2 NP2 dx dv ll\n");
   }
+  sl.gp = gp;
+  sl.lls = lls;
+  sl.rn = rn;
+  sl.distances = distances;
   for (i=0; i<num_leaf_nodes; i++) {
     //fprintf(stderr, ".");
-    struct tree3_node *n = phasetree->root +  process_order[i];
+    struct tree3_node *n = phasetree->root + leaf_order[i].index;
     if (n->ll > 1e10 || !n->num_points) continue;
     //Need to sort by roots, also put -1's at end
     partition_sort_particles(0, n->num_points, n->points, particle_smallfofs + (n->points - f->particles));
+    fast3tree_points_moved(phasetree, n->points - phasetree->points, n->num_points);
     int64_t j_start = 0;
     int64_t main_halo = -1;
     for (; j_start<n->num_points; j_start++) {
@@ -407,21 +702,14 @@ void _find_subfofs_better3(struct fof *f) {
 
     float ll = n->ll;
     ll *= GALAXY_LINKING_LENGTH;
+    sl.leaf = n;
+    sl.r = ll;
+    sl.r2 = ll*ll;
     for (j=0; j<n->num_points; j++) {
-      //fast3tree_find_sphere_marked(phasetree, res, n->points[j].pos, ll, 0, 1);
-      fast3tree_find_sphere(phasetree, res, n->points[j].pos, ll);
-      int64_t sf = main_halo;
-      for (k=0; k<res->num_points; k++) {
-	int64_t sf2 = SMALLFOF_OF(res->points[k]);
-	if (sf2 < 0) {
-	  SMALLFOF_OF(res->points[k]) = sf;
-	  gp[sf]++;
-	} else {
-	  _collapse_smallfof(smallfofs+sf2);
-	  sf2 = smallfofs[sf2].root;
-	  sf = main_halo = join_subfofs_if_needed(sf, sf2, n, gp, lls, rn, distances);
-	}
-      }
+      sl.c = n->points[j].pos;
+      sl.sf = main_halo;
+      _link_star_sphere(phasetree->root, &sl);
+      main_halo = sl.sf;
     }
   }
 
@@ -444,10 +732,8 @@ void _find_subfofs_better3(struct fof *f) {
   }
 
   if (distances) fclose(distances);
-  free(lls);
-  free(gp);
-  free(rn);
-  free(process_order);
+  arena_release(&scratch, mark);
+  leaf_groups = NULL;
   build_fullfofs();
 }
 
@@ -642,6 +928,190 @@ void merge_galaxies(int64_t num_dm_halos) {
 }
 
 
+struct fast3tree *_level_phasetree(int64_t level) {
+  int64_t i;
+  if (level >= num_level_trees) {
+    check_realloc_s(level_trees, sizeof(struct fast3tree *), level+1);
+    for (i=num_level_trees; i<=level; i++)
+      level_trees[i] = fast3tree_init(0, NULL);
+    num_level_trees = level+1;
+  }
+  level_trees[level]->num_threads = level_tree_threads ? level_tree_threads : NUM_THREADS;
+  return level_trees[level];
+}
+
+void free_level_phasetrees(void) {
+  int64_t i;
+  for (i=0; i<num_level_trees; i++) fast3tree_free(level_trees + i);
+  check_realloc_s(level_trees, 0, 0);
+  num_level_trees = 0;
+  phasetree = NULL;
+}
+
+/* Appends num halos (with their extra info) to the current thread's
+   list, shifting the halo indices they refer to by offset. */
+#define REMAP_HALO_INDEX(x) if ((x) > -1) (x) += offset
+void _append_halos(struct halo *h, struct extra_halo_info *ei, int64_t num,
+		   int64_t offset) {
+  int64_t i;
+  struct extra_halo_info *nei;
+  for (i=0; i<num; i++) {
+    add_new_halo();
+    halos[num_halos-1] = h[i];
+    nei = extra_info + num_halos - 1;
+    *nei = ei[i];
+    nei->moments.version = -1; //Cached by another thread
+    REMAP_HALO_INDEX(nei->child);
+    REMAP_HALO_INDEX(nei->next_cochild);
+    REMAP_HALO_INDEX(nei->prev_cochild);
+    REMAP_HALO_INDEX(nei->sub_of);
+  }
+}
+#undef REMAP_HALO_INDEX
+
+/* Sibling subFOFs are independent: each has its own range of copies[]
+   (and of particle_halos[] and particle_leaves[]), and the halos found in
+   one only refer to each other.  So for large FOFs, the siblings can be
+   handed to threads left idle by other work (idle_subs_threads).  Helper
+   threads share the caller's copies and its parent phase-space tree (which
+   is only read), but have their own scratch space, trees, and halo lists.
+   Each sibling's halos are kept apart and appended in subFOF order, so
+   that the results are the same as for the serial loop. */
+#define MIN_NESTED_SUBS_PARTICLES 100000
+int64_t idle_subs_threads = 0;
+
+struct nested_subs_info {
+  struct fof *fofs;
+  int64_t num_tasks, next, level, max_p;
+  int64_t *order, *h_count;
+  struct halo **halos;
+  struct extra_halo_info **extra_info;
+  struct particle *copies;
+  int64_t *particle_halos, *particle_leaves, num_copies;
+  struct fast3tree *parent_tree;
+};
+
+void _find_subs(struct fof *f, int64_t level);
+
+void _free_thread_halo_state(void) {
+  int64_t a, b;
+  free_particle_copies();
+  free_particle_sort_buffers();
+  free_potential_tree();
+  free(return_fullfofs(&a, &b));
+  check_realloc_s(subfofs, 0, 0);
+  num_alloced_subfofs = 0;
+  free_halos();
+  free_level_phasetrees();
+  free_prev_halo_results();
+  if (res) fast3tree_results_free(res);
+  res = NULL;
+}
+
+void _find_subs_nested_thread(int64_t thread, void *data) {
+  struct nested_subs_info *ns = data;
+  int64_t t, i, idx, max_particle_r = MAX_PARTICLES_TO_SAMPLE;
+  int64_t main_num_halos = num_halos, main_tree_threads = level_tree_threads;
+  struct halo *main_halos = halos;
+  struct extra_halo_info *main_extra_info = extra_info;
+
+  if (thread) {
+    copies = ns->copies;
+    particle_halos = ns->particle_halos;
+    particle_leaves = ns->particle_leaves;
+    num_copies = ns->num_copies;
+    if (EXACT_LL_CALC || max_particle_r > ns->max_p) max_particle_r = ns->max_p;
+    check_realloc_s(particle_r, sizeof(float), max_particle_r);
+    res = fast3tree_results_init();
+    check_realloc_s(level_trees, sizeof(struct fast3tree *), ns->level+1);
+    memset(level_trees, 0, sizeof(struct fast3tree *)*(ns->level+1));
+    level_trees[ns->level] = ns->parent_tree;
+    num_level_trees = ns->level+1;
+  }
+  halos = NULL;
+  extra_info = NULL;
+  num_halos = 0;
+  level_tree_threads = 1;
+
+  while ((t = next_thread_task(&ns->next)) < ns->num_tasks) {
+    i = ns->order[t];
+    if (num_subfofs >= num_alloced_subfofs) {
+      num_alloced_subfofs = num_subfofs + 1000;
+      check_realloc_s(subfofs, sizeof(struct fof), num_alloced_subfofs);
+    }
+    idx = num_subfofs++;
+    subfofs[idx] = ns->fofs[i];
+    _find_subs(subfofs + idx, ns->level+1);
+    num_subfofs = idx;
+    ns->halos[i] = halos;
+    ns->extra_info[i] = extra_info;
+    ns->h_count[i] = num_halos;
+    halos = NULL;
+    extra_info = NULL;
+    num_halos = 0;
+  }
+
+  if (thread) {
+    //Shared with the calling thread, so not freed here
+    copies = NULL;
+    particle_halos = particle_leaves = NULL;
+    level_trees[ns->level] = NULL;
+    _free_thread_halo_state();
+    release_idle_threads(&idle_subs_threads, 1);
+  } else {
+    halos = main_halos;
+    extra_info = main_extra_info;
+    num_halos = main_num_halos;
+    level_tree_threads = main_tree_threads;
+  }
+}
+
+/* Finds halos in subfofs[f_start..f_end-1] on this thread plus any idle
+   threads; returns 0 (having done nothing) if there are none. */
+int64_t _find_subs_nested(int64_t f_start, int64_t f_end, int64_t level) {
+  int64_t i, num_threads, *sizes = NULL;
+  struct nested_subs_info ns = {0};
+  struct arena_mark mark;
+
+  for (i=f_start; i<f_end; i++)
+    if (subfofs[i].num_p > MIN_HALO_PARTICLES) ns.num_tasks++;
+  num_threads = claim_idle_threads(&idle_subs_threads, ns.num_tasks-1);
+  if (!num_threads) return 0;
+  num_threads++;
+
+  mark = arena_mark(&scratch);
+  arena_alloc_s(&scratch, ns.fofs, sizeof(struct fof), ns.num_tasks);
+  for (i=f_start; i<f_end; i++) {
+    if (subfofs[i].num_p <= MIN_HALO_PARTICLES) continue;
+    ns.fofs[ns.next++] = subfofs[i];
+    if (subfofs[i].num_p > ns.max_p) ns.max_p = subfofs[i].num_p;
+  }
+  ns.next = 0;
+  ns.level = level;
+  ns.copies = copies;
+  ns.particle_halos = particle_halos;
+  ns.particle_leaves = particle_leaves;
+  ns.num_copies = num_copies;
+  ns.parent_tree = (level < num_level_trees) ? level_trees[level] : NULL;
+  arena_alloc_s(&scratch, ns.order, sizeof(int64_t), ns.num_tasks);
+  arena_alloc_s(&scratch, ns.h_count, sizeof(int64_t), ns.num_tasks);
+  arena_alloc_s(&scratch, ns.halos, sizeof(struct halo *), ns.num_tasks);
+  arena_alloc_s(&scratch, ns.extra_info, sizeof(struct extra_halo_info *), ns.num_tasks);
+  arena_alloc_s(&scratch, sizes, sizeof(int64_t), ns.num_tasks);
+  for (i=0; i<ns.num_tasks; i++) sizes[i] = -ns.fofs[i].num_p;
+  sort_indices_by_key(sizes, ns.num_tasks, ns.order, 1);
+
+  run_threads(num_threads, _find_subs_nested_thread, &ns);
+
+  for (i=0; i<ns.num_tasks; i++) {
+    _append_halos(ns.halos[i], ns.extra_info[i], ns.h_count[i], num_halos);
+    free(ns.halos[i]);
+    free(ns.extra_info[i]);
+  }
+  arena_release(&scratch, mark);
+  return 1;
+}
+
 void _find_subs(struct fof *f, int64_t level) {
   int64_t f_start, f_end, h_start, i, j, f_index;
   int64_t p_start, max_i = 0, is_force_res, do_higher_levels=1;
@@ -657,8 +1127,10 @@ void _find_subs(struct fof *f, int64_t level) {
   f_index = f - subfofs;
   if (do_higher_levels) {
     if (level) {
+      phasetree = _level_phasetree(level);
       if (f->particles[0].type != RTYPE_STAR)
-	_find_subfofs_better2(f, FOF_FRACTION);
+	_find_subfofs_better2(f, FOF_FRACTION, (REFIT_SUBFOF_TREES && level > 1) ?
+			      level_trees[level-1] : NULL);
       else
 	_find_subfofs_better3(f);
     }
@@ -670,9 +1142,12 @@ void _find_subs(struct fof *f, int64_t level) {
   f_end = num_subfofs;
 
   h_start = num_halos;
-  for (i=f_start; i<f_end; i++)
-    if (subfofs[i].num_p > MIN_HALO_PARTICLES)
-      _find_subs(subfofs + i, level+1);
+  if (!(__atomic_load_n(&idle_subs_threads, __ATOMIC_RELAXED) &&
+	f->num_p >= MIN_NESTED_SUBS_PARTICLES &&
+	!OUTPUT_LEVELS && _find_subs_nested(f_start, f_end, level)))
+    for (i=f_start; i<f_end; i++)
+      if (subfofs[i].num_p > MIN_HALO_PARTICLES)
+	_find_subs(subfofs + i, level+1);
 
   //Convert particle positions back to normal
   if (level>0) f = subfofs + f_index;
@@ -685,6 +1160,7 @@ void _find_subs(struct fof *f, int64_t level) {
     struct particle *c = f->particles + j;
     memcpy(c->pos, p[c->id].pos, sizeof(float)*6);
   }
+  halo_moments_version++;
 
   if (h_start == num_halos) {
     add_new_halo(); //New seed halo
@@ -721,9 +1197,12 @@ void _find_subs(struct fof *f, int64_t level) {
 	particle_halos[p_start + j] = max_i;
   } else {
     build_subtree(growing_halos, num_growing_halos);
+    struct halo **best = find_best_halos(copies+p_start, particle_halos+p_start,
+					 f->num_p, halos+max_i, level_tree_threads ?
+					 level_tree_threads : NUM_THREADS);
     for (j=0; j<f->num_p; j++) {
-      if (particle_halos[p_start + j] < 0) {
-	struct halo *h = find_best_halo(copies+p_start+j, halos+max_i);
+      if (best[j]) {
+	struct halo *h = best[j];
 	particle_halos[p_start + j] = h - halos;
 	while (extra_info[h-halos].sub_of > -1) {
 	  float max_metric = extra_info[h-halos].max_metric;
@@ -843,9 +1322,9 @@ void _find_subs(struct fof *f, int64_t level) {
 
 void find_subs(struct fof *f) {
   struct fof cf;
+  struct arena_mark mark;
   int64_t i, h_start = num_halos;
 
-  if (!phasetree) phasetree = fast3tree_init(0, NULL);
   if (!res) res = fast3tree_results_init();
 
   if (f->num_p > num_alloc_pc) alloc_particle_copies(f->num_p);
@@ -858,19 +1337,111 @@ void find_subs(struct fof *f) {
 
   if (LIGHTCONE) lightcone_set_scale(f->particles->pos);
 
+  rand_seed = f->num_p;
   num_subfofs = 0;
   _find_subs(&cf, 0);
   num_subfofs = 0;
+  arena_reset(&scratch);
   for (i=0; i<f->num_p; i++) copies[i] = p[copies[i].id];
+  halo_moments_version++;
   calc_num_child_particles(h_start);
+  mark = arena_mark(&scratch);
+  if (NESTED_HALO_ORDER) order_nested_halos(h_start);
   for (i=h_start; i<num_halos; i++) calc_basic_halo_props(halos + i);
   for (i=h_start; i<num_halos; i++) calc_additional_halo_props(halos + i);
+  num_nested_halos = 0;
+  arena_release(&scratch, mark);
 
   memcpy(f->particles, copies, sizeof(struct particle)*f->num_p);
   for (i=h_start; i<num_halos; i++)
     halos[i].p_start += (f->particles - p);
 }
 
+/* FOFs are independent, and all per-FOF state (copies, trees, subfofs,
+   halos) is thread-local, so find_subs() can run on many FOFs at once.
+   Threads take FOFs largest first from a shared counter; each thread's
+   halos are then merged in FOF order, so that the output is the same as
+   for the serial loop. */
+struct subs_thread_info {
+  struct fof *fofs;
+  int64_t num_fofs, next;
+  int64_t *order, *thread, *h_start, *h_count;
+  struct halo **halos;
+  struct extra_halo_info **extra_info;
+};
+
+
+void _find_subs_thread(int64_t thread, void *data) {
+  struct subs_thread_info *st = data;
+  int64_t t, i;
+  //FOFs are already processed in parallel, so build trees serially.
+  level_tree_threads = 1;
+  while ((t = next_thread_task(&st->next)) < st->num_fofs) {
+    i = st->order[t];
+    st->thread[i] = thread;
+    st->h_start[i] = num_halos;
+    find_subs(st->fofs + i);
+    st->h_count[i] = num_halos - st->h_start[i];
+  }
+  st->halos[thread] = halos;
+  st->extra_info[thread] = extra_info;
+  halos = NULL;
+  extra_info = NULL;
+  num_halos = 0;
+  if (thread) _free_thread_halo_state();
+  else level_tree_threads = 0;
+  //Idle from here on; other threads may use this one for large FOFs.
+  release_idle_threads(&idle_subs_threads, 1);
+}
+
+void find_subs_threaded(struct fof *fofs, int64_t num_f, int64_t num_threads) {
+  int64_t i, t, *sizes = NULL;
+  struct halo *main_halos = halos;
+  struct extra_halo_info *main_extra_info = extra_info;
+  int64_t main_num_halos = num_halos;
+  struct subs_thread_info st = {0};
+
+  st.fofs = fofs;
+  st.num_fofs = num_f;
+  check_realloc_s(st.order, sizeof(int64_t), num_f);
+  check_realloc_s(st.thread, sizeof(int64_t), num_f);
+  check_realloc_s(st.h_start, sizeof(int64_t), num_f);
+  check_realloc_s(st.h_count, sizeof(int64_t), num_f);
+  check_realloc_s(st.halos, sizeof(struct halo *), num_threads);
+  check_realloc_s(st.extra_info, sizeof(struct extra_halo_info *), num_threads);
+  check_realloc_s(sizes, sizeof(int64_t), num_f);
+  for (i=0; i<num_f; i++) sizes[i] = -fofs[i].num_p;
+  sort_indices_by_key(sizes, num_f, st.order, num_threads);
+  free(sizes);
+
+  halos = NULL;
+  extra_info = NULL;
+  num_halos = 0;
+  idle_subs_threads = 0;
+  run_threads(num_threads, _find_subs_thread, &st);
+  idle_subs_threads = 0;
+  halos = main_halos;
+  extra_info = main_extra_info;
+  num_halos = main_num_halos;
+
+  for (i=0; i<num_f; i++) {
+    t = st.thread[i];
+    _append_halos(st.halos[t] + st.h_start[i], st.extra_info[t] + st.h_start[i],
+		  st.h_count[i], num_halos - st.h_start[i]);
+  }
+
+  for (t=0; t<num_threads; t++) {
+    free(st.halos[t]);
+    free(st.extra_info[t]);
+  }
+  free(st.halos);
+  free(st.extra_info);
+  free(st.order);
+  free(st.thread);
+  free(st.h_start);
+  free(st.h_count);
+}
+
 
 void alloc_particle_copies(int64_t total_copies) {
   int64_t max_particle_r = MAX_PARTICLES_TO_SAMPLE;
@@ -878,18 +1449,21 @@ void alloc_particle_copies(int64_t total_copies) {
   if (total_copies - num_alloc_pc < 1000) total_copies = num_alloc_pc + 1000;
   check_realloc_s(copies, sizeof(struct particle), total_copies);
   check_realloc_s(particle_halos, sizeof(int64_t), total_copies);
+  check_realloc_s(particle_leaves, sizeof(int64_t), total_copies);
   if (max_particle_r > total_copies) max_particle_r = total_copies;
   check_realloc_s(particle_r, sizeof(float), max_particle_r);
   check_realloc_s(po, sizeof(struct potential), total_copies);
-  num_alloc_pc = total_copies;
+  num_alloc_pc = num_alloc_po = total_copies;
 }
 
 void free_particle_copies(void) {
-  num_alloc_pc = 0;
+  num_alloc_pc = num_alloc_po = 0;
   copies = check_realloc(copies, 0, "Freeing copies.");
   particle_halos = check_realloc(particle_halos, 0, "Freeing particle links.");
+  particle_leaves = check_realloc(particle_leaves, 0, "Freeing particle leaves.");
   particle_r = check_realloc(particle_r, 0, "Freeing particle radii.");
   po = check_realloc(po, 0, "Freeing potentials.");
+  arena_free(&scratch);
   free_subtree();
 }
 
@@ -924,7 +1498,7 @@ int64_t rad_partition(float *rad, int64_t left, int64_t right, int64_t pivot_ind
 }
 
 inline float random_unit(void) {
-  return(((float)(rand()%(RAND_MAX))/(float)(RAND_MAX)));
+  return(((float)(rand_r(&rand_seed)%(RAND_MAX))/(float)(RAND_MAX)));
 }
 
 float find_median_r(float *rad, int64_t num_p, float frac) {
@@ -12,11 +12,13 @@
 #define ALWAYS_PRINT_FLAG 16
 #define GALAXY_INELIGIBLE_FLAG 32
 
-extern struct halo *halos;
-extern int64_t num_halos;
-extern struct extra_halo_info *extra_info;
+extern __thread struct halo *halos;
+extern __thread int64_t num_halos;
+extern __thread struct extra_halo_info *extra_info;
+extern int64_t idle_subs_threads;
 
 void find_subs(struct fof *f);
+void find_subs_threaded(struct fof *fofs, int64_t num_f, int64_t num_threads);
 void calc_mass_definition(void);
 void free_particle_copies(void);
 void free_halos(void);
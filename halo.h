@@ -20,12 +20,22 @@ struct halo {
   //float half_sm_radius, sm_vrms 
 };
 
+//Mass-weighted moments of a halo's particles, cached by
+//calc_basic_halo_props() until the halo's particles change; vmax and the
+//core velocity are also kept until the halo's center or child_r change.
+struct halo_moments {
+  int64_t p_start, num_p, version;
+  double mass, mean[6], var[6], cov[2][3];
+  float vmax_cen[3], vmax_child_r, vmax, vmax_r, corevel[3];
+};
+
 struct extra_halo_info {
   int64_t child, next_cochild, prev_cochild;
   int64_t sub_of, ph;
   float max_metric, volume;
   double x_orth_matrix[3][3], v_orth_matrix[3][3];
   double x_eig[3], v_eig[3];
+  struct halo_moments moments;
 };
 
 #endif /* HALO_H */
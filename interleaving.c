@@ -17,6 +17,7 @@
 
 struct fast3tree *bp_tree = NULL;
 struct fast3tree_results *bp_res = NULL;
+uint8_t *bp_marks = NULL;
 struct bgroup *bg = NULL;
 int64_t num_bg = 0;
 int64_t max_gid, our_chunk;
@@ -38,6 +39,8 @@ void clear_bp_data(void) {
   fast3tree_results_free(bp_res);
   bp_res = NULL;
   fast3tree_free(&bp_tree);
+  free(bp_marks);
+  bp_marks = NULL;
   bp = check_realloc(bp, 0, "Freeing bp");
   num_bp = 0;
 }
@@ -138,12 +141,14 @@ void link_bgroups(int64_t gid1, int64_t gid2) {
 void mark_bgroup_tree(void) {
   int64_t i,j;
   struct tree3_node *nodes = bp_tree->root;
+  free(bp_marks);
+  bp_marks = fast3tree_marks_init(bp_tree);
   for (i=0; i<bp_tree->num_nodes; i++) {
-    if (nodes[i].flags & FAST3TREE_MARKED) continue;
+    if (FAST3TREE_MARK_TST(bp_marks, i)) continue;
     for (j=1; j<nodes[i].num_points; j++)
       if (nodes[i].points[j].bgid != nodes[i].points[0].bgid ||
 	  nodes[i].points[j].chunk != nodes[i].points[0].chunk) break;
-    if (j==nodes[i].num_points) _fast3tree_mark_node(nodes+i, FAST3TREE_MARKED);
+    if (j==nodes[i].num_points) fast3tree_mark_node(bp_tree, bp_marks, nodes+i);
   }
 }
 
@@ -170,7 +175,7 @@ void build_bgroup_links(void) {
   if (PERIODIC) _fast3tree_set_minmax(bp_tree, 0, BOX_SIZE);
   for (i=0; i<(num_bp-num_new_bp); i++) {
     int64_t gid1 = find_bgroup(bp+i);
-    fast3tree_find_sphere_marked(bp_tree, bp_res, bp[i].pos, r, PERIODIC, 1);
+    fast3tree_find_sphere_marked(bp_tree, bp_res, bp[i].pos, r, PERIODIC, 1, bp_marks);
     //if (!PERIODIC) fast3tree_find_sphere(bp_tree, bp_res, bp[i].pos, r);
     //else fast3tree_find_sphere_periodic(bp_tree, bp_res, bp[i].pos, r);
 
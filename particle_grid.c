@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include "check_syscalls.h"
+#include "particle_grid.h"
+#include "threads.h"
+#include "radix_sort.h"
+
+//Safety margin for round-off error in deciding which cells can contain
+//particles within a given distance.
+#define GRID_CELL_PAD 1e-3
+#define GRID_MAX_DIM (((int64_t)1)<<20)
+#define GRID_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+static inline uint64_t _grid_hash(struct particle_grid *g, int64_t key) {
+  return (((uint64_t)key)*GRID_HASH_MULT)>>g->hash_shift;
+}
+
+static inline int64_t _grid_find_row(struct particle_grid *g, int64_t key) {
+  uint64_t h = _grid_hash(g, key);
+  int64_t r;
+  while ((r = g->hash[h]) >= 0) {
+    if (g->rows[r].key == key) return r;
+    h = (h+1) & g->hash_mask;
+  }
+  return -1;
+}
+
+void _grid_build_hash(struct particle_grid *g) {
+  int64_t i, bits = 1;
+  uint64_t h;
+  while ((((int64_t)1)<<bits) < 2*g->num_rows) bits++;
+  g->hash_mask = (((uint64_t)1)<<bits)-1;
+  g->hash_shift = 64 - bits;
+  check_realloc_s(g->hash, sizeof(int64_t), g->hash_mask+1);
+  for (i=0; i<=g->hash_mask; i++) g->hash[i] = -1;
+  for (i=0; i<g->num_rows; i++) {
+    h = _grid_hash(g, g->rows[i].key);
+    while (g->hash[h] >= 0) h = (h+1) & g->hash_mask;
+    g->hash[h] = i;
+  }
+}
+
+struct particle_grid *particle_grid_init(int64_t num_p, struct particle *p,
+					 float cell_size) {
+  int64_t i, j, k, ic, r;
+  double max[3], cell = cell_size;
+  struct key_index *keys = NULL;
+  struct particle_grid *g = check_realloc(NULL, sizeof(struct particle_grid),
+					  "Allocating particle grid.");
+  memset(g, 0, sizeof(struct particle_grid));
+  g->p = p;
+  g->num_p = num_p;
+  if (!num_p) return g;
+
+  for (k=0; k<3; k++) g->min[k] = max[k] = p[0].pos[k];
+  for (i=1; i<num_p; i++) {
+    for (k=0; k<3; k++) {
+      if (p[i].pos[k] < g->min[k]) g->min[k] = p[i].pos[k];
+      if (p[i].pos[k] > max[k]) max[k] = p[i].pos[k];
+    }
+  }
+  if (!(cell > 0)) cell = 1;
+  for (k=0; k<3; k++)
+    if ((max[k]-g->min[k])/cell > GRID_MAX_DIM-2)
+      cell = (max[k]-g->min[k])/(double)(GRID_MAX_DIM-2);
+  g->inv_cell = 1.0/cell;
+  for (k=0; k<3; k++)
+    g->dims[k] = (int64_t)((max[k]-g->min[k])*g->inv_cell) + 1;
+
+  check_realloc_s(keys, sizeof(struct key_index), num_p);
+  for (i=0; i<num_p; i++) {
+    keys[i].index = i;
+    keys[i].key = 0;
+    for (k=2; k>=0; k--) {
+      ic = (p[i].pos[k]-g->min[k])*g->inv_cell;
+      if (ic >= g->dims[k]) ic = g->dims[k]-1;
+      keys[i].key = keys[i].key*g->dims[k] + ic;
+    }
+  }
+  radix_sort_key_index(keys, num_p, 1);
+
+  check_realloc_s(g->indices, sizeof(int64_t), num_p);
+  check_realloc_s(g->pos, sizeof(float)*3, num_p);
+  for (i=0, j=-1, r=-1; i<num_p; i++) {
+    g->indices[i] = keys[i].index;
+    memcpy(g->pos + 3*i, p[keys[i].index].pos, sizeof(float)*3);
+    if (i && keys[i].key == keys[i-1].key) continue;
+    j++;
+    if (!(j%1000)) check_realloc_s(g->cells, sizeof(struct grid_cell), j+1001);
+    g->cells[j].key = keys[i].key;
+    g->cells[j].start = i;
+    if (r >= 0 && keys[i].key/g->dims[0] == g->rows[r].key) continue;
+    r++;
+    if (!(r%1000)) check_realloc_s(g->rows, sizeof(struct grid_cell), r+1001);
+    g->rows[r].key = keys[i].key/g->dims[0];
+    g->rows[r].start = j;
+  }
+  g->num_cells = j+1;
+  g->cells[g->num_cells].key = -1;
+  g->cells[g->num_cells].start = num_p;
+  g->num_rows = r+1;
+  g->rows[g->num_rows].key = -1;
+  g->rows[g->num_rows].start = g->num_cells;
+  free(keys);
+  _grid_build_hash(g);
+  return g;
+}
+
+void particle_grid_free(struct particle_grid **g) {
+  struct particle_grid *u;
+  if (!g || !(*g)) return;
+  u = *g;
+  free(u->indices);
+  free(u->pos);
+  free(u->cells);
+  free(u->rows);
+  free(u->hash);
+  free(u);
+  *g = NULL;
+}
+
+//Finds the cells in row (y,z) with x from xlo to xhi.  Cells along a row
+//have consecutive keys, so these are cells [*c1, *c2), and their
+//particles are contiguous in the grid.
+static inline void _grid_row_cells(struct particle_grid *g, int64_t y,
+				   int64_t z, int64_t xlo, int64_t xhi,
+				   int64_t *c1, int64_t *c2) {
+  int64_t row, mid, key, lo, hi;
+  *c1 = *c2 = 0;
+  if ((row = _grid_find_row(g, z*g->dims[1] + y)) < 0) return;
+  key = (z*g->dims[1] + y)*g->dims[0];
+  lo = g->rows[row].start;
+  hi = g->rows[row+1].start;
+  while (lo < hi) { //First cell with key >= key+xlo
+    mid = lo + (hi-lo)/2;
+    if (g->cells[mid].key < key+xlo) lo = mid+1;
+    else hi = mid;
+  }
+  *c1 = lo;
+  for (hi=lo; hi<g->rows[row+1].start && g->cells[hi].key<=key+xhi; hi++);
+  *c2 = hi;
+}
+
+static inline int _grid_dist_lt(float *a, float *b, float r2) {
+  int64_t k;
+  float dist = 0, dx;
+  for (k=0; k<3; k++) {
+    dx = a[k]-b[k];
+    dist += dx*dx;
+  }
+  return (dist < r2);
+}
+
+
+/* FOF linking by cells.  If cells are small enough that any two particles
+   in the same cell are within r, each cell is linked in one shot, and
+   neighboring cells need only one linking pair (and none at all if they
+   already belong to the same group).  Otherwise, all pairs are tested. */
+#define GRID_LINK_CHUNK 1024
+struct grid_link_info {
+  struct particle_grid *g;
+  struct union_find *uf;
+  float r2, cell;
+  int64_t ext, compact, next;
+};
+
+void _grid_link_cell(struct grid_link_info *gl, int64_t c) {
+  struct particle_grid *g = gl->g;
+  int64_t i, j, start = g->cells[c].start, end = g->cells[c+1].start;
+  if (gl->compact) {
+    for (i=start+1; i<end; i++) uf_union(gl->uf, g->indices[start], g->indices[i]);
+    return;
+  }
+  for (i=start; i<end; i++)
+    for (j=i+1; j<end; j++)
+      if (_grid_dist_lt(g->pos + 3*i, g->pos + 3*j, gl->r2))
+	uf_union(gl->uf, g->indices[i], g->indices[j]);
+}
+
+void _grid_link_cell_pair(struct grid_link_info *gl, int64_t c1, int64_t c2) {
+  struct particle_grid *g = gl->g;
+  int64_t i, j, s1 = g->cells[c1].start, e1 = g->cells[c1+1].start,
+    s2 = g->cells[c2].start, e2 = g->cells[c2+1].start;
+  if (gl->compact &&
+      uf_find(gl->uf, g->indices[s1]) == uf_find(gl->uf, g->indices[s2]))
+    return;
+  for (i=s1; i<e1; i++) {
+    for (j=s2; j<e2; j++) {
+      if (!_grid_dist_lt(g->pos + 3*i, g->pos + 3*j, gl->r2)) continue;
+      uf_union(gl->uf, g->indices[i], g->indices[j]);
+      if (gl->compact) return;
+    }
+  }
+}
+
+//Minimum distance between cells that are d cells apart along one axis.
+static inline double _grid_gap(int64_t d, double cell) {
+  if (d < 0) d = -d;
+  return ((d > 1) ? (d-1)*cell : 0);
+}
+
+//Links cell c to itself and to the neighboring cells with larger keys.
+void _grid_link_neighbors(struct grid_link_info *gl, int64_t c) {
+  struct particle_grid *g = gl->g;
+  int64_t x, y, z, dx, dy, dz, xlo, c1, c2, ext = gl->ext;
+  double gap, gap2, dmin;
+  _grid_link_cell(gl, c);
+  x = g->cells[c].key % g->dims[0];
+  y = (g->cells[c].key / g->dims[0]) % g->dims[1];
+  z = g->cells[c].key / (g->dims[0]*g->dims[1]);
+  for (dz=0; dz<=ext && z+dz<g->dims[2]; dz++) {
+    for (dy=(dz ? -ext : 0); dy<=ext; dy++) {
+      if (y+dy < 0 || y+dy >= g->dims[1]) continue;
+      xlo = (!dz && !dy) ? x+1 : x-ext;
+      _grid_row_cells(g, y+dy, z+dz, xlo, x+ext, &c1, &c2);
+      gap = _grid_gap(dz, gl->cell);
+      gap2 = gap*gap;
+      gap = _grid_gap(dy, gl->cell);
+      gap2 += gap*gap;
+      for (; c1<c2; c1++) {
+	dx = g->cells[c1].key - (g->cells[c].key + dz*g->dims[0]*g->dims[1]
+				 + dy*g->dims[0]);
+	gap = _grid_gap(dx, gl->cell);
+	dmin = gap2 + gap*gap;
+	if (dmin >= gl->r2) continue; //Cells too far apart to link
+	_grid_link_cell_pair(gl, c, c1);
+      }
+    }
+  }
+}
+
+void _grid_link_thread(int64_t thread, void *data) {
+  struct grid_link_info *gl = data;
+  int64_t c, start, end;
+  while ((start = next_thread_task(&gl->next)*GRID_LINK_CHUNK) < gl->g->num_cells) {
+    end = start + GRID_LINK_CHUNK;
+    if (end > gl->g->num_cells) end = gl->g->num_cells;
+    for (c=start; c<end; c++) _grid_link_neighbors(gl, c);
+  }
+}
+
+//Links all pairs of particles closer than r in uf (whose elements are
+//the particle indices in the grid).  Cells should be smaller than
+//r/sqrt(3) to make use of the shortcut for dense regions.
+void particle_grid_link(struct particle_grid *g, float r, struct union_find *uf,
+			int64_t num_threads) {
+  struct grid_link_info gl = {0};
+  gl.g = g;
+  gl.uf = uf;
+  gl.r2 = r*r;
+  gl.cell = (1.0-GRID_CELL_PAD)/g->inv_cell;
+  gl.ext = ceil(r*g->inv_cell*(1.0+GRID_CELL_PAD));
+  gl.compact = (sqrt(3.0)*(1.0+GRID_CELL_PAD)/g->inv_cell < r);
+  run_threads(num_threads, _grid_link_thread, &gl);
+}
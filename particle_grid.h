@@ -0,0 +1,36 @@
+#ifndef _PARTICLE_GRID_H_
+#define _PARTICLE_GRID_H_
+#include <stdint.h>
+#include "particle.h"
+#include "union_find.h"
+
+/* Uniform grid (chaining mesh) for fixed-radius neighbor searches.
+   Particles are indexed by cell, with positions copied in cell order.
+   Non-empty cells are stored in order, grouped into rows along x; rows
+   are found through a hash table, so that empty cells take no memory. */
+
+struct grid_cell {
+  int64_t key, start;
+};
+
+struct particle_grid {
+  struct particle *p;
+  int64_t num_p;
+  double min[3], inv_cell;
+  int64_t dims[3];
+  int64_t *indices;
+  float *pos;
+  struct grid_cell *cells, *rows;
+  int64_t num_cells, num_rows;
+  int64_t *hash;
+  uint64_t hash_mask;
+  int64_t hash_shift;
+};
+
+struct particle_grid *particle_grid_init(int64_t num_p, struct particle *p,
+					 float cell_size);
+void particle_grid_free(struct particle_grid **g);
+void particle_grid_link(struct particle_grid *g, float r, struct union_find *uf,
+			int64_t num_threads);
+
+#endif /* _PARTICLE_GRID_H_ */
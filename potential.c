@@ -2,16 +2,41 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include "check_syscalls.h"
 #include "config_vars.h"
 #include "universal_constants.h"
 #include "potential.h"
 #include "hubble.h"
+#include "threads.h"
 
+#ifndef POTENTIAL_ERR_TOL
 #define POTENTIAL_ERR_TOL 1.0
+#endif /* !def POTENTIAL_ERR_TOL */
 #define POTENTIAL_USE_BH 1
 #ifndef POTENTIAL_HALT_AFTER_BOUND
 #define POTENTIAL_HALT_AFTER_BOUND 0
 #endif /* !def POTENTIAL_HALT_AFTER_BOUND */
+#ifndef POTENTIAL_USE_LISTS
+#define POTENTIAL_USE_LISTS 1
+#endif /* !def POTENTIAL_USE_LISTS */
+#ifndef POTENTIAL_FMM_THETA
+#define POTENTIAL_FMM_THETA 0.7
+#endif /* !def POTENTIAL_FMM_THETA */
+#define POTENTIAL_THREAD_LEAVES 64 //Tree nodes per threaded task
+#define POTENTIAL_THREAD_TARGETS 1024 //Particles per threaded removal task
+//Cost of a tree walk step for removed sources, relative to a direct
+//(vectorized) interaction
+#ifndef POTENTIAL_WALK_COST
+#define POTENTIAL_WALK_COST 100
+#endif /* !def POTENTIAL_WALK_COST */
+
+//Barnes-Hut error tolerance and FMM opening angle (larger is faster and
+//less accurate); util/potential_bench changes them to compare the two
+//methods at the same error.
+double potential_err_tol = POTENTIAL_ERR_TOL;
+double potential_fmm_theta = POTENTIAL_FMM_THETA;
 
 inline double _distance2(float *p1, float *p2) {
   double dx, r2=0;
@@ -50,18 +75,36 @@ void _compute_indirect_potential(struct potential *po, int64_t num_po,
 #define FAST3TREE_EXTRA_INFO float mass_center[3]; float m, dmin; int64_t num_unbound;
 #include "fast3tree.c"
 
-struct fast3tree *p_tree = NULL;
-struct fast3tree_results *p_res = NULL;
+__thread struct fast3tree *p_tree = NULL;
+__thread struct fast3tree_results *p_res = NULL;
+
+/* For the interaction-list potential: tree point positions and masses as
+   separate arrays, and the sources (particles from nearby leaves and the
+   mass centers of distant nodes) for the current leaf. */
+#define POTENTIAL_LANES 8
+#define POTENTIAL_CHUNK 256
+struct interaction_list {
+  float *x, *y, *z, *m;
+  int64_t num, num_alloced;
+};
+__thread float *p_x = NULL, *p_y = NULL, *p_z = NULL, *p_m = NULL;
+__thread int64_t p_num_alloced = 0;
+__thread struct interaction_list p_il = {0};
 
+//Massless points (targets only) do not count towards the node size.
 void _compute_dmin(struct tree3_node *n) {
   double sum_x2 = 0, bmax = 0, dx;
+  int64_t num_massive = 0;
   for (int64_t i=0; i<n->num_points; i++) {
+    if (!n->points[i].mass) continue;
     dx = _distance2(n->mass_center, n->points[i].pos);
     if (bmax < dx) bmax = dx;
     sum_x2 += dx;
+    num_massive++;
   }
   bmax = sqrt(bmax)/2.0;
-  n->dmin = bmax + sqrt(bmax*bmax+sum_x2 / (n->num_points*POTENTIAL_ERR_TOL));
+  n->dmin = num_massive ?
+    (bmax + sqrt(bmax*bmax+sum_x2 / (num_massive*potential_err_tol))) : 0;
 }
 
 void _ignore_unbound(struct tree3_node *n) {
@@ -88,7 +131,7 @@ void _compute_mass_centers(struct tree3_node *n) {
       for (j=0; j<3; j++) pos[j]+=n->points[i].pos[j]*n->points[i].mass;
     }
     for (j=0; j<3; j++)
-      n->mass_center[j] = n->m ? pos[j]/n->m : 0;
+      n->mass_center[j] = n->m ? pos[j]/n->m : 0.5*(n->min[j]+n->max[j]);
     _compute_dmin(n);
     n->num_unbound = n->num_points;
     _ignore_unbound(n);
@@ -99,7 +142,8 @@ void _compute_mass_centers(struct tree3_node *n) {
   n->m = n->left->m + n->right->m;
   for (j=0; j<3; j++)
     n->mass_center[j] = n->m ? ((n->right->mass_center[j]*n->right->m +
-				 n->left->mass_center[j]*n->left->m)/n->m) : 0;
+				 n->left->mass_center[j]*n->left->m)/n->m)
+      : 0.5*(n->min[j]+n->max[j]);
   _compute_dmin(n);
 }
 
@@ -141,27 +185,595 @@ void _compute_monopole_potentials(struct tree3_node *n, struct tree3_node *n2) {
   }
 }
 
-void _compute_barnes_hut_potential(struct potential *po, int64_t num_po)
+void _il_reserve(struct interaction_list *il, int64_t n) {
+  if (il->num + n <= il->num_alloced) return;
+  il->num_alloced = (il->num + n)*2 + 1024;
+  check_realloc_s(il->x, sizeof(float), il->num_alloced);
+  check_realloc_s(il->y, sizeof(float), il->num_alloced);
+  check_realloc_s(il->z, sizeof(float), il->num_alloced);
+  check_realloc_s(il->m, sizeof(float), il->num_alloced);
+}
+
+void _il_add(struct interaction_list *il, float *pos, float m) {
+  _il_reserve(il, 1);
+  il->x[il->num] = pos[0];
+  il->y[il->num] = pos[1];
+  il->z[il->num] = pos[2];
+  il->m[il->num] = m;
+  il->num++;
+}
+
+//Adds the particles in tree points [start, start+n) as sources.
+void _il_add_points(struct interaction_list *il, int64_t start, int64_t n) {
+  _il_reserve(il, n);
+  memcpy(il->x + il->num, p_x + start, sizeof(float)*n);
+  memcpy(il->y + il->num, p_y + start, sizeof(float)*n);
+  memcpy(il->z + il->num, p_z + start, sizeof(float)*n);
+  memcpy(il->m + il->num, p_m + start, sizeof(float)*n);
+  il->num += n;
+}
+
+//Same opening criteria as _compute_monopole_potentials(), but collects
+//the sources for leaf n rather than summing them.
+void _build_interaction_list(struct tree3_node *n, struct tree3_node *n2,
+			     struct interaction_list *il) {
+  int64_t i;
+  if (n == n2 || !n2->m) return; //Done directly, or no sources
+  for (i=0; i<3; i++) if (n->min[i] < n2->min[i] || n->max[i]>n2->max[i]) break;
+  if (i==3 || !_monopole_acceptable(n, n2)) {
+    if (n2->div_dim < 0)
+      _il_add_points(il, n2->points - p_tree->points, n2->num_points);
+    else {
+      _build_interaction_list(n, n2->left, il);
+      _build_interaction_list(n, n2->right, il);
+    }
+  }
+  else _il_add(il, n2->mass_center, n2->m);
+}
+
+/* Sums the potential from all the sources in il at each of the first
+   num_unbound points in leaf n.  Sources are padded to a multiple of
+   POTENTIAL_LANES with zero masses, so that the inner loop has a fixed
+   length and is vectorized by the compiler; partial sums are kept in
+   single precision for at most POTENTIAL_CHUNK sources at a time. */
+void _pad_interaction_list(struct interaction_list *il) {
+  float zero[3] = {0};
+  while (il->num % POTENTIAL_LANES) _il_add(il, zero, 0);
+}
+
+//Returns the potential at (cx, cy, cz) from a padded interaction list.
+double _list_potential(struct interaction_list *il, float cx, float cy, float cz) {
+  int64_t j, k, l, end;
+  float fr = (FORCE_RES > FLT_MIN) ? FORCE_RES : FLT_MIN;
+  float acc[POTENTIAL_LANES], dx, dy, dz, r;
+  double pe = 0;
+  for (j=0; j<il->num; j=end) {
+    end = j+POTENTIAL_CHUNK;
+    if (end > il->num) end = il->num;
+    for (l=0; l<POTENTIAL_LANES; l++) acc[l] = 0;
+    for (k=j; k<end; k+=POTENTIAL_LANES) {
+      for (l=0; l<POTENTIAL_LANES; l++) {
+	dx = il->x[k+l] - cx;
+	dy = il->y[k+l] - cy;
+	dz = il->z[k+l] - cz;
+	r = sqrtf(dx*dx + dy*dy + dz*dz);
+	if (r < fr) r = fr;
+	acc[l] += il->m[k+l] / r;
+      }
+    }
+    for (l=0; l<POTENTIAL_LANES; l++) pe += acc[l];
+  }
+  return pe;
+}
+
+void _sum_interaction_list(struct tree3_node *n, struct interaction_list *il) {
+  int64_t i, offset = n->points - p_tree->points;
+  _pad_interaction_list(il);
+  for (i=0; i<n->num_unbound; i++)
+    n->points[i].pe += _list_potential(il, p_x[offset+i], p_y[offset+i],
+				       p_z[offset+i]);
+}
+
+//Copies particle positions and masses (in tree order) for
+//_sum_interaction_list().
+void _fill_source_arrays(struct potential *po, int64_t num_po) {
+  int64_t i;
+  if (num_po > p_num_alloced) {
+    p_num_alloced = num_po;
+    check_realloc_s(p_x, sizeof(float), p_num_alloced);
+    check_realloc_s(p_y, sizeof(float), p_num_alloced);
+    check_realloc_s(p_z, sizeof(float), p_num_alloced);
+    check_realloc_s(p_m, sizeof(float), p_num_alloced);
+  }
+  for (i=0; i<num_po; i++) {
+    p_x[i] = po[i].pos[0];
+    p_y[i] = po[i].pos[1];
+    p_z[i] = po[i].pos[2];
+    p_m[i] = po[i].mass;
+  }
+}
+
+void _compute_list_potentials(struct tree3_node *n, struct interaction_list *il) {
+  assert(n->div_dim < 0);
+  if (n->num_points <= (2*POINTS_PER_LEAF)) //Else degenerate node
+    _compute_direct_potential(n->points, n->num_points);
+  if (!n->num_unbound) return;
+  il->num = 0;
+  _build_interaction_list(n, p_tree->root, il);
+  _sum_interaction_list(n, il);
+}
+
+/* Leaves only write the potentials of their own points, so they can be
+   handed out to threads in blocks.  Helper threads borrow the caller's
+   tree and source arrays, but have their own interaction lists. */
+struct potential_thread_info {
+  struct fast3tree *tree;
+  float *x, *y, *z, *m;
+  int64_t next;
+};
+
+void _compute_leaf_potentials(int64_t thread, void *data) {
+  struct potential_thread_info *pt = data;
+  struct interaction_list il = {0}, *list = thread ? &il : &p_il;
+  int64_t i, start, end;
+  if (thread) {
+    p_tree = pt->tree;
+    p_x = pt->x; p_y = pt->y; p_z = pt->z; p_m = pt->m;
+  }
+  while ((start = next_thread_task(&pt->next)*POTENTIAL_THREAD_LEAVES)
+	 < p_tree->num_nodes) {
+    end = start + POTENTIAL_THREAD_LEAVES;
+    if (end > p_tree->num_nodes) end = p_tree->num_nodes;
+    for (i=start; i<end; i++) {
+      if (p_tree->root[i].div_dim >= 0) continue;
+#if POTENTIAL_USE_LISTS && !POTENTIAL_HALT_AFTER_BOUND
+      _compute_list_potentials(p_tree->root + i, list);
+#else
+      _compute_monopole_potentials(p_tree->root + i, p_tree->root);
+#endif /* POTENTIAL_USE_LISTS */
+    }
+  }
+  if (thread) {
+    p_tree = NULL;
+    p_x = p_y = p_z = p_m = NULL;
+    free(il.x);
+    free(il.y);
+    free(il.z);
+    free(il.m);
+  }
+}
+
+void _compute_barnes_hut_potential(struct potential *po, int64_t num_po,
+				   int64_t num_threads)
 {
+  struct potential_thread_info pt = {0};
   if (!p_tree) p_tree = fast3tree_init(0, NULL);
   if (!p_res) p_res = fast3tree_results_init();
 
+  p_tree->num_threads = num_threads;
   fast3tree_rebuild(p_tree, num_po, po);
   _compute_mass_centers(p_tree->root);
-  for (int64_t i=0; i<p_tree->num_nodes; i++)
-    if (p_tree->root[i].div_dim < 0)
-      _compute_monopole_potentials(p_tree->root + i, p_tree->root);
+#if POTENTIAL_USE_LISTS && !POTENTIAL_HALT_AFTER_BOUND
+  _fill_source_arrays(po, num_po);
+#endif /* POTENTIAL_USE_LISTS */
+  pt.tree = p_tree;
+  pt.x = p_x; pt.y = p_y; pt.z = p_z; pt.m = p_m;
+  run_threads(num_threads, _compute_leaf_potentials, &pt);
+}
+
+/* Fast multipole method: each tree node has the mass and quadrupole
+   moments of its particles about their center of mass (z), and a local
+   (second-order Taylor) expansion of the potential from well-separated
+   nodes about the same center.  Pairs of nodes are interacted once, in
+   both directions (_fmm_interact()), and the local expansions are then
+   passed down to the particles (_fmm_evaluate()).  Leaves too close for
+   that are paired up, and summed directly from interaction lists. */
+struct fmm_node {
+  double z[3], m, q[6], r; //q is xx, yy, zz, xy, xz, yz
+  double phi, g[3], h[6];
+  int64_t first_pair, num_pairs;
+};
+__thread struct fmm_node *fmm = NULL;
+__thread int64_t fmm_num_alloced = 0;
+__thread int64_t *fmm_pairs = NULL, *fmm_neighbors = NULL,
+  fmm_num_pairs = 0, fmm_pairs_alloced = 0;
+
+#define FMM_SYM(i,j) (((i)==(j)) ? (i) : (2+(i)+(j)))
+#define FMM_NODE(n) (fmm + ((n) - p_tree->root))
+
+//Returns the product x.A.y for symmetric A.
+double _fmm_sym_product(double *a, double *x, double *y) {
+  int64_t i, j;
+  double s = 0;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++) s += x[i]*a[FMM_SYM(i,j)]*y[j];
+  return s;
+}
+
+void _fmm_add_moments(struct fmm_node *f, double *d, double m) {
+  int64_t i, j;
+  for (i=0; i<3; i++)
+    for (j=i; j<3; j++) f->q[FMM_SYM(i,j)] += m*d[i]*d[j];
+}
+
+void _fmm_multipoles(struct tree3_node *n) {
+  int64_t i, j;
+  double d[3], r, r2, zm[3] = {0};
+  struct fmm_node *f = FMM_NODE(n), *c[2];
+  memset(f, 0, sizeof(struct fmm_node));
+  if (n->div_dim < 0) {
+    for (i=0; i<n->num_points; i++) {
+      f->m += n->points[i].mass;
+      for (j=0; j<3; j++) zm[j] += n->points[i].mass*n->points[i].pos[j];
+    }
+  } else {
+    _fmm_multipoles(n->left);
+    _fmm_multipoles(n->right);
+    c[0] = FMM_NODE(n->left);
+    c[1] = FMM_NODE(n->right);
+    for (i=0; i<2; i++) {
+      f->m += c[i]->m;
+      for (j=0; j<3; j++) zm[j] += c[i]->m*c[i]->z[j];
+    }
+  }
+  for (j=0; j<3; j++)
+    f->z[j] = (f->m > 0) ? zm[j]/f->m : 0.5*(n->min[j]+n->max[j]);
+
+  if (n->div_dim < 0) {
+    for (i=0; i<n->num_points; i++) {
+      for (j=0, r2=0; j<3; j++) {
+	d[j] = n->points[i].pos[j] - f->z[j];
+	r2 += d[j]*d[j];
+      }
+      _fmm_add_moments(f, d, n->points[i].mass);
+      if (r2 > f->r*f->r) f->r = sqrt(r2);
+    }
+    return;
+  }
+  for (i=0; i<2; i++) {
+    for (j=0, r2=0; j<3; j++) {
+      d[j] = c[i]->z[j] - f->z[j];
+      r2 += d[j]*d[j];
+    }
+    for (j=0; j<6; j++) f->q[j] += c[i]->q[j];
+    _fmm_add_moments(f, d, c[i]->m);
+    r = sqrt(r2) + c[i]->r;
+    if (r > f->r) f->r = r;
+  }
+  //The farthest box corner is also a bound on the node size
+  for (j=0, r2=0; j<3; j++) {
+    d[j] = fmax(f->z[j] - n->min[j], n->max[j] - f->z[j]);
+    r2 += d[j]*d[j];
+  }
+  if (r2 < f->r*f->r) f->r = sqrt(r2);
 }
 
-void compute_potential(struct potential *po, int64_t num_po) {
+//Adds the potential of each node (to quadrupole order) to the local
+//expansion of the other; R = a->z - b->z.
+void _fmm_m2l(struct fmm_node *a, struct fmm_node *b, double *R) {
+  int64_t i, j;
+  double r2 = R[0]*R[0]+R[1]*R[1]+R[2]*R[2];
+  double ir = 1.0/sqrt(r2), ir3 = ir*ir*ir, ir5 = ir3*ir*ir, ir7 = ir5*ir*ir;
+  double d1[3], d2[6], qa[3], qb[3], rqa, rqb, tra, trb, d3a, d3b;
+  for (i=0; i<3; i++) d1[i] = -R[i]*ir3;
+  for (i=0; i<3; i++)
+    for (j=i; j<3; j++)
+      d2[FMM_SYM(i,j)] = 3.0*R[i]*R[j]*ir5 - ((i==j) ? ir3 : 0);
+  tra = a->q[0] + a->q[1] + a->q[2];
+  trb = b->q[0] + b->q[1] + b->q[2];
+  for (i=0; i<3; i++) {
+    for (j=0, qa[i]=qb[i]=0; j<3; j++) {
+      qa[i] += a->q[FMM_SYM(i,j)]*R[j];
+      qb[i] += b->q[FMM_SYM(i,j)]*R[j];
+    }
+  }
+  rqa = R[0]*qa[0] + R[1]*qa[1] + R[2]*qa[2];
+  rqb = R[0]*qb[0] + R[1]*qb[1] + R[2]*qb[2];
+
+  a->phi += b->m*ir + 0.5*(3.0*rqb*ir5 - trb*ir3);
+  b->phi += a->m*ir + 0.5*(3.0*rqa*ir5 - tra*ir3);
+  for (i=0; i<3; i++) {
+    //Gradients of the quadrupole terms; these change sign from b to a
+    d3b = -7.5*rqb*R[i]*ir7 + 1.5*(2.0*qb[i] + trb*R[i])*ir5;
+    d3a = -7.5*rqa*R[i]*ir7 + 1.5*(2.0*qa[i] + tra*R[i])*ir5;
+    a->g[i] += b->m*d1[i] + d3b;
+    b->g[i] -= a->m*d1[i] + d3a;
+  }
+  for (i=0; i<6; i++) {
+    a->h[i] += b->m*d2[i];
+    b->h[i] += a->m*d2[i];
+  }
+}
+
+void _fmm_interact(struct tree3_node *a, struct tree3_node *b) {
+  int64_t k;
+  double R[3], r2 = 0, rs;
+  struct fmm_node *fa = FMM_NODE(a), *fb = FMM_NODE(b);
+  if (!a->num_points || !b->num_points || (!fa->m && !fb->m)) return;
+  if (a == b) {
+    if (a->div_dim < 0) {
+      if (a->num_points <= (2*POINTS_PER_LEAF)) //Else degenerate node
+	_compute_direct_potential(a->points, a->num_points);
+      return;
+    }
+    _fmm_interact(a->left, a->left);
+    _fmm_interact(a->left, a->right);
+    _fmm_interact(a->right, a->right);
+    return;
+  }
+
+  for (k=0; k<3; k++) { R[k] = fa->z[k] - fb->z[k]; r2 += R[k]*R[k]; }
+  rs = (fa->r + fb->r)/potential_fmm_theta;
+  if (r2 > rs*rs && r2 > FORCE_RES*FORCE_RES) {
+    _fmm_m2l(fa, fb, R);
+    return;
+  }
+  if (a->div_dim < 0 && b->div_dim < 0) {
+    if (fmm_num_pairs+2 > fmm_pairs_alloced) {
+      fmm_pairs_alloced = fmm_pairs_alloced*1.5 + 1000;
+      check_realloc_s(fmm_pairs, sizeof(int64_t), fmm_pairs_alloced);
+    }
+    fmm_pairs[fmm_num_pairs++] = a - p_tree->root;
+    fmm_pairs[fmm_num_pairs++] = b - p_tree->root;
+    fa->num_pairs++;
+    fb->num_pairs++;
+    return;
+  }
+  if (b->div_dim < 0 || (a->div_dim >= 0 && fa->r >= fb->r)) {
+    _fmm_interact(a->left, b);
+    _fmm_interact(a->right, b);
+  } else {
+    _fmm_interact(a, b->left);
+    _fmm_interact(a, b->right);
+  }
+}
+
+//Shifts local expansions down the tree and evaluates them at each particle.
+void _fmm_evaluate(struct tree3_node *n) {
+  int64_t i, j, k;
+  double s[3], hs[3];
+  struct fmm_node *f = FMM_NODE(n), *c;
+  if (n->div_dim < 0) {
+    for (i=0; i<n->num_points; i++) {
+      for (k=0; k<3; k++) s[k] = n->points[i].pos[k] - f->z[k];
+      n->points[i].pe += f->phi + f->g[0]*s[0] + f->g[1]*s[1] + f->g[2]*s[2]
+	+ 0.5*_fmm_sym_product(f->h, s, s);
+    }
+    return;
+  }
+  for (i=0; i<2; i++) {
+    c = FMM_NODE(i ? n->right : n->left);
+    for (k=0; k<3; k++) s[k] = c->z[k] - f->z[k];
+    for (k=0; k<3; k++)
+      for (j=0, hs[k]=0; j<3; j++) hs[k] += f->h[FMM_SYM(k,j)]*s[j];
+    c->phi += f->phi + f->g[0]*s[0] + f->g[1]*s[1] + f->g[2]*s[2]
+      + 0.5*(hs[0]*s[0] + hs[1]*s[1] + hs[2]*s[2]);
+    for (k=0; k<3; k++) c->g[k] += f->g[k] + hs[k];
+    for (k=0; k<6; k++) c->h[k] += f->h[k];
+  }
+  _fmm_evaluate(n->left);
+  _fmm_evaluate(n->right);
+}
+
+//Sums the direct potentials from the leaves paired with each leaf.
+void _fmm_neighbor_potentials(struct interaction_list *il) {
+  int64_t i, j, offset = 0;
+  struct tree3_node *n, *n2;
+  struct fmm_node *f;
+  for (i=0; i<p_tree->num_nodes; i++) {
+    fmm[i].first_pair = offset;
+    offset += fmm[i].num_pairs;
+    fmm[i].num_pairs = 0;
+  }
+  check_realloc_s(fmm_neighbors, sizeof(int64_t), fmm_num_pairs);
+  for (i=0; i<fmm_num_pairs; i+=2) {
+    f = fmm + fmm_pairs[i];
+    fmm_neighbors[f->first_pair + f->num_pairs++] = fmm_pairs[i+1];
+    f = fmm + fmm_pairs[i+1];
+    fmm_neighbors[f->first_pair + f->num_pairs++] = fmm_pairs[i];
+  }
+  for (i=0; i<p_tree->num_nodes; i++) {
+    n = p_tree->root + i;
+    if (n->div_dim >= 0 || !n->num_unbound || !fmm[i].num_pairs) continue;
+    il->num = 0;
+    for (j=0; j<fmm[i].num_pairs; j++) {
+      n2 = p_tree->root + fmm_neighbors[fmm[i].first_pair + j];
+      _il_add_points(il, n2->points - p_tree->points, n2->num_points);
+    }
+    _sum_interaction_list(n, il);
+  }
+}
+
+void _compute_fmm_potential(struct potential *po, int64_t num_po,
+			    int64_t num_threads) {
+  if (!p_tree) p_tree = fast3tree_init(0, NULL);
+  p_tree->num_threads = num_threads;
+  fast3tree_rebuild(p_tree, num_po, po);
+  _compute_mass_centers(p_tree->root);
+  _fill_source_arrays(po, num_po);
+  if (p_tree->num_nodes > fmm_num_alloced) {
+    fmm_num_alloced = p_tree->num_nodes;
+    check_realloc_s(fmm, sizeof(struct fmm_node), fmm_num_alloced);
+  }
+  fmm_num_pairs = 0;
+  _fmm_multipoles(p_tree->root);
+  _fmm_interact(p_tree->root, p_tree->root);
+  _fmm_neighbor_potentials(&p_il);
+  _fmm_evaluate(p_tree->root);
+}
+
+//Uses up to num_threads threads for halos with at least
+//POTENTIAL_MIN_THREAD_PARTICLES particles.
+void compute_potential(struct potential *po, int64_t num_po, int64_t num_threads) {
   for (int64_t i=0; i<num_po; i++) { po[i].pe = 0; }
+  if (num_po < POTENTIAL_MIN_THREAD_PARTICLES || num_threads < 1) num_threads = 1;
 #if POTENTIAL_USE_BH
-  _compute_barnes_hut_potential(po, num_po);
+  if (FMM_MIN_PARTICLES > 0 && num_po >= FMM_MIN_PARTICLES)
+    _compute_fmm_potential(po, num_po, num_threads);
+  else
+    _compute_barnes_hut_potential(po, num_po, num_threads);
 #else
   _compute_direct_potential(po, num_po);
 #endif /* POTENTIAL_USE_BH */
 }
 
+/* Removing sources: the potential tree is built over the removed
+   particles only, and the remaining particles (the targets) are grouped
+   into the leaves of a second tree, so that each group of nearby targets
+   walks the source tree once (with the same opening criteria as
+   _build_interaction_list()).  The interaction lists, and so the cost per
+   target, grow with the number removed rather than with the halo size.
+   Few removed particles are summed directly instead. */
+__thread struct fast3tree *p_target_tree = NULL;
+__thread struct potential *p_removed = NULL;
+__thread int64_t p_removed_alloced = 0;
+
+struct removal_thread_info {
+  struct fast3tree *tree, *targets;
+  struct interaction_list *il; //Removed particles, if summed directly
+  float *x, *y, *z, *m;
+  struct potential *po;
+  int64_t num_po, next;
+};
+
+//Mass centers of target leaves (box centers for massless leaves).
+void _compute_leaf_centers(struct fast3tree *t) {
+  int64_t i, j, k;
+  double pos[3], m;
+  struct tree3_node *n;
+  for (i=0; i<t->num_nodes; i++) {
+    n = t->root + i;
+    if (n->div_dim >= 0) continue;
+    pos[0] = pos[1] = pos[2] = m = 0;
+    for (j=0; j<n->num_points; j++) {
+      m += n->points[j].mass;
+      for (k=0; k<3; k++) pos[k] += n->points[j].pos[k]*n->points[j].mass;
+    }
+    for (k=0; k<3; k++)
+      n->mass_center[k] = m ? pos[k]/m : 0.5*(n->min[k]+n->max[k]);
+  }
+}
+
+void _remove_sources_direct(int64_t thread, void *data) {
+  struct removal_thread_info *ri = data;
+  struct potential *po;
+  int64_t i, start, end;
+  while ((start = next_thread_task(&ri->next)*POTENTIAL_THREAD_TARGETS)
+	 < ri->num_po) {
+    end = start + POTENTIAL_THREAD_TARGETS;
+    if (end > ri->num_po) end = ri->num_po;
+    for (i=start; i<end; i++) {
+      po = ri->po + i;
+      po->pe -= _list_potential(ri->il, po->pos[0], po->pos[1], po->pos[2]);
+    }
+  }
+}
+
+//As in _compute_leaf_potentials(), helper threads borrow the caller's
+//source tree and arrays.
+void _remove_sources_tree(int64_t thread, void *data) {
+  struct removal_thread_info *ri = data;
+  struct interaction_list il = {0}, *list = thread ? &il : &p_il;
+  struct tree3_node *n;
+  int64_t i, j, start, end;
+  float *pos;
+  if (thread) {
+    p_tree = ri->tree;
+    p_x = ri->x; p_y = ri->y; p_z = ri->z; p_m = ri->m;
+  }
+  while ((start = next_thread_task(&ri->next)*POTENTIAL_THREAD_LEAVES)
+	 < ri->targets->num_nodes) {
+    end = start + POTENTIAL_THREAD_LEAVES;
+    if (end > ri->targets->num_nodes) end = ri->targets->num_nodes;
+    for (i=start; i<end; i++) {
+      n = ri->targets->root + i;
+      if (n->div_dim >= 0 || !n->num_points) continue;
+      list->num = 0;
+      _build_interaction_list(n, p_tree->root, list);
+      _pad_interaction_list(list);
+      for (j=0; j<n->num_points; j++) {
+	pos = n->points[j].pos;
+	n->points[j].pe -= _list_potential(list, pos[0], pos[1], pos[2]);
+      }
+    }
+  }
+  if (thread) {
+    p_tree = NULL;
+    p_x = p_y = p_z = p_m = NULL;
+    free(il.x);
+    free(il.y);
+    free(il.z);
+    free(il.m);
+  }
+}
+
+//Subtracts the potentials of removed particles from those of the
+//remaining ones (which may be reordered, as with compute_potential());
+//removed[] is not changed.
+void remove_potential_sources(struct potential *po, int64_t num_po,
+			      struct potential *removed, int64_t num_removed,
+			      int64_t num_threads) {
+  int64_t j;
+  double direct_cost, tree_cost;
+  struct removal_thread_info ri = {0};
+  if (!num_po || !num_removed) return;
+  if (num_po < POTENTIAL_MIN_THREAD_PARTICLES || num_threads < 1) num_threads = 1;
+  ri.po = po;
+  ri.num_po = num_po;
+
+  direct_cost = (double)num_po*num_removed;
+  tree_cost = POTENTIAL_WALK_COST*(double)(num_po+num_removed)*log2(num_removed);
+  if (direct_cost <= tree_cost) {
+    p_il.num = 0;
+    for (j=0; j<num_removed; j++) _il_add(&p_il, removed[j].pos, removed[j].mass);
+    _pad_interaction_list(&p_il);
+    ri.il = &p_il;
+    run_threads(num_threads, _remove_sources_direct, &ri);
+    return;
+  }
+
+  if (num_removed > p_removed_alloced) {
+    p_removed_alloced = num_removed;
+    check_realloc_s(p_removed, sizeof(struct potential), p_removed_alloced);
+  }
+  memcpy(p_removed, removed, sizeof(struct potential)*num_removed);
+  if (!p_tree) p_tree = fast3tree_init(0, NULL);
+  if (!p_target_tree) p_target_tree = fast3tree_init(0, NULL);
+  p_tree->num_threads = p_target_tree->num_threads = num_threads;
+  fast3tree_rebuild(p_tree, num_removed, p_removed);
+  _compute_mass_centers(p_tree->root);
+  _fill_source_arrays(p_removed, num_removed);
+  fast3tree_rebuild(p_target_tree, num_po, po);
+  _compute_leaf_centers(p_target_tree);
+  ri.tree = p_tree;
+  ri.targets = p_target_tree;
+  ri.x = p_x; ri.y = p_y; ri.z = p_z; ri.m = p_m;
+  run_threads(num_threads, _remove_sources_tree, &ri);
+}
+
+void free_potential_tree(void) {
+  fast3tree_free(&p_tree);
+  if (p_res) fast3tree_results_free(p_res);
+  p_res = NULL;
+  check_realloc_s(p_x, 0, 0);
+  check_realloc_s(p_y, 0, 0);
+  check_realloc_s(p_z, 0, 0);
+  check_realloc_s(p_m, 0, 0);
+  p_num_alloced = 0;
+  check_realloc_s(p_il.x, 0, 0);
+  check_realloc_s(p_il.y, 0, 0);
+  check_realloc_s(p_il.z, 0, 0);
+  check_realloc_s(p_il.m, 0, 0);
+  p_il.num = p_il.num_alloced = 0;
+  check_realloc_s(fmm, 0, 0);
+  check_realloc_s(fmm_pairs, 0, 0);
+  check_realloc_s(fmm_neighbors, 0, 0);
+  fmm_num_alloced = fmm_pairs_alloced = fmm_num_pairs = 0;
+  fast3tree_free(&p_target_tree);
+  check_realloc_s(p_removed, 0, 0);
+  p_removed_alloced = 0;
+}
+
 void compute_kinetic_energy(struct potential *po, int64_t num_po, float *vel_cen, float *pos_cen) {
   int64_t i,j;
   double dv=0, conv_const = 0.5 * SCALE_NOW / Gc;
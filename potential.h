@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #define POTENTIAL_DONT_CALCULATE_FLAG 1
+#define POTENTIAL_MIN_THREAD_PARTICLES 100000
 
 struct potential {
   float pos[6], r2, mass, energy;
@@ -20,7 +21,13 @@ struct potential {
 #endif /* CALC_POTENTIALS */
 };
 
+extern double potential_err_tol, potential_fmm_theta;
+
 void compute_kinetic_energy(struct potential *po, int64_t num_po, float *vel_cen, float *pos_cen);
-void compute_potential(struct potential *po, int64_t num_po);
+void compute_potential(struct potential *po, int64_t num_po, int64_t num_threads);
+void remove_potential_sources(struct potential *po, int64_t num_po,
+			      struct potential *removed, int64_t num_removed,
+			      int64_t num_threads);
+void free_potential_tree(void);
 
 #endif /* _POTENTIAL_H_ */
@@ -57,55 +57,97 @@ void estimate_vmax(struct halo *h, int64_t include_children) {
 }
 
 
-void calc_basic_halo_props(struct halo *h) {
-  int64_t j, k, l, num_all=0;
-  double pos[6] = {0}, pos2[6] = {0}, x, x2;
-  double pos_err, vel_err;
-  h->r = h->vrms = 0;
-  double total_mass = 0;
-  double corr_matrix[2][3][3];
+//Finds the mass-weighted mean and (co)variances of a halo's particles in
+//a single pass, with West's weighted form of Welford's update; unlike
+//raw sums, this does not lose precision for halos far from the origin
+//or with distant outlying particles.
+void _calc_halo_moments(struct halo *h, struct halo_moments *hm) {
+  int64_t j, k;
+  double d[6], mean[6] = {0}, s2[6] = {0}, c[2][3] = {{0}}, w, f, m = 0;
+  struct particle *hp = copies + h->p_start;
 
   for (j=0; j<h->num_p; j++) {
-    num_all++;
-    total_mass += copies[h->p_start + j].mass;
-    for (k=0; k<6; k++) pos[k] += copies[h->p_start + j].pos[k]*
-			  copies[h->p_start + j].mass;
+    w = hp[j].mass;
+    if (!(w > 0)) continue;
+    m += w;
+    f = w/m;
+    for (k=0; k<6; k++) {
+      d[k] = hp[j].pos[k] - mean[k];
+      mean[k] += f*d[k];
+    }
+    w *= 1.0 - f;
+    for (k=0; k<6; k++) s2[k] += w*d[k]*d[k];
+    for (k=0; k<2; k++) {
+      c[k][0] += w*d[3*k+1]*d[3*k];
+      c[k][1] += w*d[3*k+2]*d[3*k];
+      c[k][2] += w*d[3*k+2]*d[3*k+1];
+    }
   }
 
-  for (j=0; j<2; j++)
-    for (k=0; k<3; k++)
-      memset(corr_matrix[j][k], 0, sizeof(double)*3);
-
-  if (!(total_mass > 0)) return;
-  for (k=0; k<6; k++) pos[k] /= (double)total_mass;
+  hm->mass = m;
+  if (!(m > 0)) return;
+  for (k=0; k<6; k++) {
+    hm->mean[k] = mean[k];
+    hm->var[k] = s2[k]/m;
+  }
+  for (k=0; k<2; k++)
+    for (j=0; j<3; j++) hm->cov[k][j] = c[k][j]/m;
+}
 
+void _calc_core_vel(struct halo *h, double *cen) {
+  int64_t j, k, num_core = 0;
+  double vel[3] = {0}, core_mass = 0;
   for (j=0; j<h->num_p; j++) {
-    for (k=0; k<6; k++) {
-      x = copies[h->p_start + j].pos[k] - pos[k];
-      pos2[k] += x*x*copies[h->p_start + j].mass;
-      l = (k<3) ? 0 : 3;
-      for (; l<k; l++) {
-	x2 = x*(copies[h->p_start + j].pos[l] - pos[l]) * 
-	  copies[h->p_start + j].mass;
-	if (k<3) corr_matrix[0][k][l] += x2;
-	else corr_matrix[1][k-3][l-3] += x2;
-      }
-    }
+    double dx=0, ds=0;
+    for (k=0; k<3; k++) {dx = cen[k]-copies[h->p_start + j].pos[k]; ds+=dx*dx;}
+    if (ds > (0.01*h->vmax_r*h->vmax_r)) continue;
+    num_core++;
+    for (k=0; k<3; k++) vel[k] += copies[h->p_start + j].pos[k+3]*copies[h->p_start+j].mass;
+    core_mass += copies[h->p_start+j].mass;
+  }
+  if (num_core > 100 && (core_mass >0)) {
+    for (k=0; k<3; k++) h->corevel[k] = vel[k] / core_mass;
+  } else {
+    for (k=0; k<3; k++) h->corevel[k] = h->bulkvel[k];
   }
+}
 
+//Halo moments are cached until the halo's particles change, which is
+//tracked by halo_moments_version (see reassign_halo_particles()).
+void calc_basic_halo_props(struct halo *h) {
+  int64_t j, k, num_all=h->num_p;
+  double pos[6];
+  double pos_err, vel_err;
+  h->r = h->vrms = 0;
+  double total_mass = 0;
+  double corr_matrix[2][3][3];
+  struct extra_halo_info *ei = extra_info + (h-halos);
+  struct halo_moments *hm = &(ei->moments);
+
+  if (!h->num_p) return;
+  if (hm->version != halo_moments_version || hm->p_start != h->p_start ||
+      hm->num_p != h->num_p) {
+    _calc_halo_moments(h, hm);
+    hm->p_start = h->p_start;
+    hm->num_p = h->num_p;
+    hm->version = halo_moments_version;
+    hm->vmax_child_r = -1;
+  }
+
+  total_mass = hm->mass;
+  if (!(total_mass > 0)) return;
   for (k=0; k<6; k++) {
-    if (k<3) h->r += pos2[k] / total_mass;
-    else h->vrms += pos2[k] / total_mass;
-    int64_t cm=0, k2=k;
-    if (k>=3) { cm = 1; k2=k-3; }
-    corr_matrix[cm][k2][k2] = pos2[k]/total_mass;
-    for (l=0; l<k2; l++) {
-      corr_matrix[cm][k2][l] /= total_mass;
-      corr_matrix[cm][l][k2] = corr_matrix[cm][k2][l];
-    }
+    pos[k] = hm->mean[k];
+    if (k<3) h->r += hm->var[k];
+    else h->vrms += hm->var[k];
+  }
+  for (j=0; j<2; j++) {
+    for (k=0; k<3; k++) corr_matrix[j][k][k] = hm->var[3*j+k];
+    corr_matrix[j][1][0] = corr_matrix[j][0][1] = hm->cov[j][0];
+    corr_matrix[j][2][0] = corr_matrix[j][0][2] = hm->cov[j][1];
+    corr_matrix[j][2][1] = corr_matrix[j][1][2] = hm->cov[j][2];
   }
 
-  struct extra_halo_info *ei = extra_info + (h-halos);
   jacobi_decompose(corr_matrix[0], ei->x_eig, ei->x_orth_matrix);
   jacobi_decompose(corr_matrix[1], ei->v_eig, ei->v_orth_matrix);
   ei->volume = 1;
@@ -141,25 +183,22 @@ void calc_basic_halo_props(struct halo *h) {
   
   h->r = cbrt(h->m/((4.0*M_PI/3.0)*particle_rvir_dens));
   h->child_r = cbrt(h->num_child_particles/((4.0*M_PI/3.0)*particle_rvir_dens));
-  estimate_vmax(h, 0);
-  if (h->vmax_r) h->r = h->vmax_r;
-  h->vrms = sqrt(h->vrms);
-
-  pos[3] = pos[4] = pos[5] = 0;
-  total_mass = num_all = 0;
-  for (j=0; j<h->num_p; j++) {
-    double dx=0, ds=0;
-    for (k=0; k<3; k++) {dx = pos[k]-copies[h->p_start + j].pos[k]; ds+=dx*dx;}
-    if (ds > (0.01*h->vmax_r*h->vmax_r)) continue;
-    num_all++;
-    for (k=0; k<3; k++) pos[k+3] += copies[h->p_start + j].pos[k+3]*copies[h->p_start+j].mass;
-    total_mass += copies[h->p_start+j].mass;
-  }
-  if (num_all > 100 && (total_mass >0)) {
-    for (k=0; k<3; k++) h->corevel[k] = pos[k+3] / total_mass;
+  if (hm->vmax_child_r == h->child_r &&
+      !memcmp(hm->vmax_cen, h->pos, sizeof(float)*3)) {
+    h->vmax = hm->vmax;
+    h->vmax_r = hm->vmax_r;
+    memcpy(h->corevel, hm->corevel, sizeof(float)*3);
   } else {
-    for (k=0; k<3; k++) h->corevel[k] = h->bulkvel[k];
+    estimate_vmax(h, 0);
+    _calc_core_vel(h, pos);
+    memcpy(hm->vmax_cen, h->pos, sizeof(float)*3);
+    hm->vmax_child_r = h->child_r;
+    hm->vmax = h->vmax;
+    hm->vmax_r = h->vmax_r;
+    memcpy(hm->corevel, h->corevel, sizeof(float)*3);
   }
+  if (h->vmax_r) h->r = h->vmax_r;
+  h->vrms = sqrt(h->vrms);
   //if (h->type != RTYPE_DM) h->r = sqrt(max_eig);
 }
 
@@ -480,9 +519,34 @@ void _calc_additional_halo_props(struct halo *h, int64_t total_p, int64_t bound)
   }
 }
 
+//Removes the potentials of unbound particles (pe < ke) from the rest, and
+//repeats until no more become unbound or UNBINDING_ITERATIONS passes.
+//Unbound particles keep their potentials, so they stay unbound.
+void _iterative_unbinding(int64_t total_p, int64_t num_threads) {
+  int64_t i, iter, num_bound = total_p, new_bound;
+  struct potential tmp;
+  for (iter=1; iter<UNBINDING_ITERATIONS; iter++) {
+    for (i=0, new_bound=num_bound; i<new_bound; i++) {
+      if (po[i].pe < po[i].ke) {
+	new_bound--;
+	tmp = po[i];
+	po[i] = po[new_bound];
+	po[new_bound] = tmp;
+	i--;
+      }
+    }
+    if (new_bound == num_bound) break;
+    remove_potential_sources(po, new_bound, po+new_bound, num_bound-new_bound,
+			     num_threads);
+    num_bound = new_bound;
+  }
+  if (num_bound < total_p)
+    sort_potentials_by_radius(po, total_p);
+}
+
 //Assumes center + velocity already calculated.
 void calc_additional_halo_props(struct halo *h) {
-  int64_t j, total_p;
+  int64_t j, total_p, num_threads = 1;
   double dens_thresh;
 
   if (LIGHTCONE) lightcone_set_scale(h->pos);
@@ -490,25 +554,30 @@ void calc_additional_halo_props(struct halo *h) {
   if (h->num_p < 1) return;
   total_p = calc_particle_radii(h, h, h->pos, 0, 0, 0);
   if (BOUND_OUT_TO_HALO_EDGE) {
-    qsort(po, total_p, sizeof(struct potential), dist_compare);
+    sort_potentials_by_radius(po, total_p);
     for (j=total_p-1; j>=0; j--)
       if (j*j / (po[j].r2*po[j].r2*po[j].r2) > dens_thresh*dens_thresh) break;
     if (total_p) total_p = j+1;
   }
 
-  if (total_p>1) compute_potential(po, total_p);
+  //Large halos may borrow threads left idle by other halo finding work.
+  if (total_p >= POTENTIAL_MIN_THREAD_PARTICLES)
+    num_threads += claim_idle_threads(&idle_subs_threads, NUM_THREADS-1);
+  if (total_p>1) compute_potential(po, total_p, num_threads);
   for (j=0; j<total_p; j++)
     if (po[j].ke < 0) {
       total_p--;
       po[j] = po[total_p];
       j--;
     }
-  qsort(po, total_p, sizeof(struct potential), dist_compare);
+  sort_potentials_by_radius(po, total_p);
   calculate_corevel(h, po, total_p);
   if (extra_info[h-halos].sub_of > -1)
     compute_kinetic_energy(po, total_p, h->corevel, h->pos);
   else
     compute_kinetic_energy(po, total_p, h->bulkvel, h->pos);
+  if (UNBINDING_ITERATIONS > 1) _iterative_unbinding(total_p, num_threads);
+  if (num_threads > 1) release_idle_threads(&idle_subs_threads, num_threads-1);
 
   _calc_additional_halo_props(h, total_p, 0);
   _calc_additional_halo_props(h, total_p, 1);
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "check_syscalls.h"
+#include "radix_sort.h"
+#include "threads.h"
+
+//Key ranges up to RADIX_MAX_BINS are sorted in one counting pass;
+//larger ones use passes of RADIX_BITS each.
+#define RADIX_BITS 11
+#define RADIX_MAX_BINS (1<<16)
+#define RADIX_MIN_THREAD_SIZE 100000
+
+struct radix_pass {
+  struct key_index *src, *dst;
+  int64_t n, shift, mask, num_bins, num_threads;
+  int64_t *counts;
+};
+
+#define RADIX_CHUNK_START(rp,t) (((rp)->n*(t))/(rp)->num_threads)
+
+void _radix_count(int64_t thread, void *data) {
+  struct radix_pass *rp = data;
+  int64_t i, *counts = rp->counts + thread*rp->num_bins,
+    end = RADIX_CHUNK_START(rp, thread+1);
+  memset(counts, 0, sizeof(int64_t)*rp->num_bins);
+  for (i=RADIX_CHUNK_START(rp, thread); i<end; i++)
+    counts[(rp->src[i].key >> rp->shift) & rp->mask]++;
+}
+
+void _radix_scatter(int64_t thread, void *data) {
+  struct radix_pass *rp = data;
+  int64_t i, *counts = rp->counts + thread*rp->num_bins,
+    end = RADIX_CHUNK_START(rp, thread+1);
+  for (i=RADIX_CHUNK_START(rp, thread); i<end; i++)
+    rp->dst[counts[(rp->src[i].key >> rp->shift) & rp->mask]++] = rp->src[i];
+}
+
+//Stable LSD radix sort of ki[] by key; keys must be non-negative.  Each
+//thread histograms and scatters its own contiguous chunk, which keeps
+//the sort stable for any number of threads.
+void radix_sort_key_index(struct key_index *ki, int64_t n, int64_t num_threads) {
+  int64_t i, t, b, sum, c, bits, max_key = 0;
+  struct key_index *tmp = NULL;
+  struct radix_pass rp = {0};
+  if (n < 2) return;
+  for (i=0; i<n; i++) if (ki[i].key > max_key) max_key = ki[i].key;
+  if (!max_key) return;
+  for (bits=0; (max_key>>bits) > 0; bits++);
+
+  if (n < RADIX_MIN_THREAD_SIZE || num_threads < 1) num_threads = 1;
+  rp.n = n;
+  rp.num_threads = num_threads;
+  if (max_key < RADIX_MAX_BINS) rp.num_bins = max_key+1;
+  else rp.num_bins = 1<<RADIX_BITS;
+  rp.mask = (max_key < RADIX_MAX_BINS) ? -1 : rp.num_bins-1;
+  check_realloc_s(rp.counts, sizeof(int64_t), rp.num_bins*num_threads);
+  check_realloc_s(tmp, sizeof(struct key_index), n);
+  rp.src = ki;
+  rp.dst = tmp;
+
+  for (rp.shift=0; rp.shift<bits; rp.shift+=RADIX_BITS) {
+    run_threads(num_threads, _radix_count, &rp);
+    for (b=0, sum=0; b<rp.num_bins; b++) {
+      for (t=0; t<num_threads; t++) {
+	c = rp.counts[t*rp.num_bins + b];
+	rp.counts[t*rp.num_bins + b] = sum;
+	sum += c;
+      }
+    }
+    run_threads(num_threads, _radix_scatter, &rp);
+    tmp = rp.src; rp.src = rp.dst; rp.dst = tmp;
+    if (rp.num_bins > max_key) break; //Single counting pass
+  }
+
+  if (rp.src != ki) {
+    memcpy(ki, rp.src, sizeof(struct key_index)*n);
+    rp.dst = rp.src;
+  }
+  free(rp.dst);
+  free(rp.counts);
+}
+
+//Finds the permutation that stably sorts keys[] (which may be negative),
+//so that keys[perm[0]] <= keys[perm[1]] <= ...  Small key ranges are
+//done with a single counting pass; others with radix_sort_key_index().
+void sort_indices_by_key(int64_t *keys, int64_t n, int64_t *perm,
+			 int64_t num_threads) {
+  int64_t i, c, sum, min_key, max_key, *counts = NULL;
+  struct key_index *ki = NULL;
+  if (n < 1) return;
+  min_key = max_key = keys[0];
+  for (i=1; i<n; i++) {
+    if (keys[i] < min_key) min_key = keys[i];
+    if (keys[i] > max_key) max_key = keys[i];
+  }
+
+  if (max_key - min_key < n || max_key - min_key < RADIX_MAX_BINS) {
+    check_realloc_s(counts, sizeof(int64_t), max_key-min_key+1);
+    memset(counts, 0, sizeof(int64_t)*(max_key-min_key+1));
+    for (i=0; i<n; i++) counts[keys[i]-min_key]++;
+    for (i=0, sum=0; i<=max_key-min_key; i++) {
+      c = counts[i];
+      counts[i] = sum;
+      sum += c;
+    }
+    for (i=0; i<n; i++) perm[counts[keys[i]-min_key]++] = i;
+    free(counts);
+    return;
+  }
+
+  check_realloc_s(ki, sizeof(struct key_index), n);
+  for (i=0; i<n; i++) {
+    ki[i].key = keys[i] - min_key;
+    ki[i].index = i;
+  }
+  radix_sort_key_index(ki, n, num_threads);
+  for (i=0; i<n; i++) perm[i] = ki[i].index;
+  free(ki);
+}
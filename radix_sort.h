@@ -0,0 +1,13 @@
+#ifndef _RADIX_SORT_H_
+#define _RADIX_SORT_H_
+#include <stdint.h>
+
+struct key_index {
+  int64_t key, index;
+};
+
+void radix_sort_key_index(struct key_index *ki, int64_t n, int64_t num_threads);
+void sort_indices_by_key(int64_t *keys, int64_t n, int64_t *perm,
+			 int64_t num_threads);
+
+#endif /* _RADIX_SORT_H_ */
@@ -24,6 +24,7 @@
 #include <strings.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "rockstar.h"
 #include "particle.h"
 #include "fof.h"
@@ -32,9 +33,13 @@
 #include "config_vars.h"
 #include "io/meta_io.h"
 #include "bitarray.h"
+#include "particle_grid.h"
+#include "radix_sort.h"
+#include "threads.h"
 
 #define FAST3TREE_TYPE struct particle
 #define FAST3TREE_PREFIX ROCKSTAR
+#define FAST3TREE_COMPACT
 #define POINTS_PER_LEAF 20
 #include "fast3tree.c"
 
@@ -44,38 +49,155 @@ struct bparticle *bp = NULL;
 int64_t num_p = 0, num_bp = 0, num_additional_p = 0;
 struct fast3tree *tree = NULL;
 struct fast3tree_results *rockstar_res = NULL;
-char *skip = NULL;
 struct fof *all_fofs = NULL;
 int64_t num_all_fofs = 0, num_bfofs = 0, num_metafofs = 0;
 int64_t num_fofs_tosend = 0;
 int64_t *fof_order = NULL;
+double particle_sort_time = 0, particle_tree_time = 0, particle_link_time = 0;
+
+double wall_time(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec + 1e-6*tv.tv_usec);
+}
+
+struct morton_keys {
+  struct key_index *ki;
+  struct particle *sorted_p;
+  int64_t num_threads, bits;
+  float *bounds; //Per-thread [min[3], max[3]]
+  double min[3], scale;
+};
+
+#define MORTON_CHUNK_START(mk,t) ((num_p*(t))/(mk)->num_threads)
+
+//Spreads the lowest 21 bits of x out to every third bit.
+static inline uint64_t _morton_spread(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffULL;
+  x = (x | x << 16) & 0x1f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2) & 0x1249249249249249ULL;
+  return x;
+}
+
+void _morton_bounds(int64_t thread, void *data) {
+  struct morton_keys *mk = data;
+  int64_t i, j, end = MORTON_CHUNK_START(mk, thread+1);
+  float *b = mk->bounds + thread*6;
+  for (j=0; j<3; j++) { b[j] = 1e30; b[j+3] = -1e30; }
+  for (i=MORTON_CHUNK_START(mk, thread); i<end; i++) {
+    for (j=0; j<3; j++) {
+      if (p[i].pos[j] < b[j]) b[j] = p[i].pos[j];
+      if (p[i].pos[j] > b[j+3]) b[j+3] = p[i].pos[j];
+    }
+  }
+}
+
+void _morton_calc_keys(int64_t thread, void *data) {
+  struct morton_keys *mk = data;
+  int64_t i, j, end = MORTON_CHUNK_START(mk, thread+1);
+  int64_t max_cell = (1 << mk->bits) - 1;
+  uint64_t key;
+  double x;
+  for (i=MORTON_CHUNK_START(mk, thread); i<end; i++) {
+    key = 0;
+    for (j=0; j<3; j++) {
+      x = (p[i].pos[j] - mk->min[j])*mk->scale;
+      if (!(x > 0)) x = 0; //Also catches NaNs
+      if (x > max_cell) x = max_cell;
+      key |= _morton_spread((uint64_t)x) << j;
+    }
+    mk->ki[i].key = key;
+    mk->ki[i].index = i;
+  }
+}
+
+void _morton_gather(int64_t thread, void *data) {
+  struct morton_keys *mk = data;
+  int64_t i, end = MORTON_CHUNK_START(mk, thread+1);
+  for (i=MORTON_CHUNK_START(mk, thread); i<end; i++)
+    mk->sorted_p[i] = p[mk->ki[i].index];
+}
+
+/* Reorders p[] along a Morton (Z-order) curve, with roughly one particle
+   per curve cell, so that particles close in space are also close in
+   memory.  Particles otherwise arrive in file order, which makes the
+   in-place partitioning of the tree build, FOF linking, and the copies
+   made in find_subs() jump all over memory.  The particles are gathered
+   into a new array rather than permuted in place, since following
+   permutation cycles is latency-bound (~5x slower); this briefly needs
+   memory for a second copy of p[]. */
+void sort_particles_morton(void) {
+  int64_t i, j, num_threads = NUM_THREADS;
+  double max_width = 0;
+  struct morton_keys mk = {0};
+  if (num_p < 2) return;
+  if (num_threads < 1) num_threads = 1;
+  mk.num_threads = num_threads;
+  check_realloc_s(mk.bounds, sizeof(float)*6, num_threads);
+  run_threads(num_threads, _morton_bounds, &mk);
+  for (j=0; j<3; j++) {
+    mk.min[j] = mk.bounds[j];
+    for (i=1; i<num_threads; i++)
+      if (mk.bounds[i*6+j] < mk.min[j]) mk.min[j] = mk.bounds[i*6+j];
+    for (i=0; i<num_threads; i++)
+      if (mk.bounds[i*6+j+3] - mk.min[j] > max_width)
+	max_width = mk.bounds[i*6+j+3] - mk.min[j];
+  }
+  free(mk.bounds);
+  if (!(max_width > 0) || !(max_width < 1e30)) return;
+
+  for (mk.bits=1; mk.bits<21 && ((int64_t)1<<(3*mk.bits)) < num_p; mk.bits++);
+  mk.scale = (double)((int64_t)1 << mk.bits) / max_width;
+  check_realloc_s(mk.ki, sizeof(struct key_index), num_p);
+  run_threads(num_threads, _morton_calc_keys, &mk);
+  radix_sort_key_index(mk.ki, num_p, num_threads);
+
+  check_realloc_s(mk.sorted_p, sizeof(struct particle), num_p);
+  run_threads(num_threads, _morton_gather, &mk);
+  free(p);
+  p = mk.sorted_p;
+  free(mk.ki);
+}
+
+/* Links each particle to all of its neighbors within r (i.e., exact FOF).
+   Links go directly into the concurrent union-find (passed explicitly,
+   since FOF state is thread-local), so pairs can be linked by any number
+   of threads in any order.  Without FOF_GRID, pairs are found by a
+   dual-tree walk over the particle tree (which holds p in tree order). */
+void link_particles(float r) {
+  struct union_find *uf = get_particle_links();
+  struct particle_grid *g = NULL;
+  if (FOF_GRID) {
+    g = particle_grid_init(num_p, p, r*FOF_GRID_CELL_FRACTION);
+    particle_grid_link(g, r, uf, NUM_THREADS);
+    particle_grid_free(&g);
+  }
+  else fast3tree_link_pairs(tree, r, uf_union_callback, uf);
+}
 
 void rockstar(float *bounds, int64_t manual_subs) {
   int64_t i;
   float r;
   float bounds2[6];
+  double start;
 
   calc_mass_definition();
   r = AVG_PARTICLE_SPACING * FOF_LINKING_LENGTH;
   if (FORCE_RES*SCALE_NOW > FORCE_RES_PHYS_MAX)
     FORCE_RES = FORCE_RES_PHYS_MAX/SCALE_NOW;
+  start = wall_time();
+  if (MORTON_SORT_PARTICLES) sort_particles_morton();
+  particle_sort_time = wall_time() - start;
+  start = wall_time();
   build_particle_tree();
+  particle_tree_time = wall_time() - start;
+  start = wall_time();
   init_particle_smallfofs(num_p, p);
-  skip = BIT_ALLOC(num_p);
-  BIT_ALL_CLEAR(skip, num_p);
-
-  for (i=0; i<num_p; i++) {
-    if (BIT_TST(skip,i)) continue;
-    fast3tree_find_sphere(tree, rockstar_res, p[i].pos, r);
-    link_particle_to_fof(p+i, rockstar_res->num_points, rockstar_res->points);
-    if (rockstar_res->num_points > FOF_SKIP_THRESH) {
-      for (int64_t j=0; j<rockstar_res->num_points; j++)
-	BIT_SET(skip,(rockstar_res->points[j]-p));
-      fast3tree_find_sphere(tree, rockstar_res, p[i].pos, 2.0*r);
-      link_fof_to_fof(p+i, rockstar_res->num_points, rockstar_res->points);
-    }
-  }
-  skip = check_realloc(skip, 0, "Freeing skip memory.");
+  link_particles(r);
+  particle_link_time = wall_time() - start;
   if (bounds) {
     for (i=0; i<3; i++) {
       bounds2[i] = bounds[i]+r*1.01; //Include extra buffer for round-off error.
@@ -104,8 +226,17 @@ void rockstar(float *bounds, int64_t manual_subs) {
     for (i=0; i<num_bp; i++) bp[i].bgid += num_all_fofs - num_bfofs;
 
   if (!manual_subs) {
-    for (i=0; i<num_all_fofs; i++)
-      find_subs(all_fofs + i);
+    //Lightcone, level, and temporal outputs use shared state; keep them serial.
+    if (NUM_THREADS > 1 && !LIGHTCONE && !OUTPUT_LEVELS &&
+	!(TEMPORAL_HALO_FINDING && PARALLEL_IO))
+      find_subs_threaded(all_fofs, num_all_fofs, NUM_THREADS);
+    else {
+      //Threads are still free to search large FOFs' subgroups in parallel.
+      idle_subs_threads = NUM_THREADS-1;
+      for (i=0; i<num_all_fofs; i++)
+	find_subs(all_fofs + i);
+      idle_subs_threads = 0;
+    }
 
     rockstar_cleanup();
   }
@@ -282,6 +413,7 @@ void do_workunit(struct workunit_info *w, struct fof *fofs) {
   struct fof tmp;
   halos = check_realloc(halos, 0, "Freeing halo memory.");
   num_halos = 0;
+  idle_subs_threads = NUM_THREADS-1;
   for (i=0; i<w->num_fofs; i++) {
     tmp = fofs[i];
     if (fofs[i].particles) tmp.particles = p + processed_parts;
@@ -293,6 +425,7 @@ void do_workunit(struct workunit_info *w, struct fof *fofs) {
     if (fofs[i].particles) processed_parts += tmp.num_p;
     else processed_parts2 += tmp.num_p;
   }
+  idle_subs_threads = 0;
   assert((processed_parts == w->num_particles) &&
 	 (processed_parts2 == (w->num_meta_p+w->num_particles)));
 }
@@ -300,7 +433,9 @@ void do_workunit(struct workunit_info *w, struct fof *fofs) {
 void build_particle_tree(void) {
   int64_t i, dup_particles = 0;
   struct particle *last_p;
-  tree = fast3tree_init(num_p, p);
+  tree = fast3tree_init(0, NULL);
+  tree->num_threads = NUM_THREADS;
+  fast3tree_rebuild(tree, num_p, p);
   rockstar_res = fast3tree_results_init();
   if (IGNORE_PARTICLE_IDS)
     for (i=0; i<num_p; i++) p[i].id = i;
@@ -334,6 +469,7 @@ void clear_particle_tree(void) {
 void rockstar_cleanup() {
   check_realloc_s(all_fofs, 0, 0);
   free_particle_copies();
+  free_particle_sort_buffers();
   check_realloc_s(fof_order, 0, 0);
   num_all_fofs = num_metafofs = num_bfofs = 0;
 }
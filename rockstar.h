@@ -12,13 +12,16 @@
 
 #define MIN_WORKUNIT 5000000
 #define LARGE_FOF (MIN_WORKUNIT / sizeof(struct particle))
-#define FOF_SKIP_THRESH 16
+//Grid cells must be smaller than 1/sqrt(3) of the linking length for the
+//dense-cell shortcut (see particle_grid_link()).
+#define FOF_GRID_CELL_FRACTION 0.57
 
 extern struct particle *p;
 extern struct bparticle *bp;
 extern int64_t num_p, num_bp, num_additional_p;
 extern int64_t num_all_fofs;
 extern struct fof *all_fofs;
+extern double particle_sort_time, particle_tree_time, particle_link_time;
 
 struct workunit_info {
   int64_t num_fofs, num_halos, num_particles, chunk;
@@ -31,7 +34,10 @@ struct workunit_info {
 void rockstar(float *bounds, int64_t manual_subs);
 void rockstar_cleanup();
 void prune_fofs(float *bounds);
+double wall_time(void);
+void sort_particles_morton(void);
 void build_particle_tree(void);
+void link_particles(float r);
 void clear_particle_tree(void);
 struct particle ** find_halo_sphere(struct halo *h, int64_t *num_results);
 int sort_fofs(const void *a, const void *b);
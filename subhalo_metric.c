@@ -6,6 +6,7 @@
 #include "subhalo_metric.h"
 #include "check_syscalls.h"
 #include "groupies.h"
+#include "threads.h"
 
 #define FAST3TREE_TYPE struct halo_metric
 #define FAST3TREE_DIM 4
@@ -15,10 +16,21 @@
 
 #define INV_RADIUS_WEIGHTING -0.2 //Forces divisions along the radius dimension
 
-struct fast3tree *subtree = NULL;
-struct halo_metric *sub_metric = NULL;
-struct fast3tree_results *subtree_res = NULL;
-int64_t alloced_metrics = 0;
+__thread struct fast3tree *subtree = NULL;
+__thread struct halo_metric *sub_metric = NULL;
+__thread struct fast3tree_results *subtree_res = NULL;
+__thread int64_t alloced_metrics = 0;
+
+struct metric_params {
+  float pos[3], vel[3], r2, vrms2;
+  int32_t skip[2]; //For non-DM and DM particles
+  int32_t scale_v; //Downweight velocities of non-DM particles
+};
+
+__thread struct metric_params *metric_params = NULL;
+__thread struct halo **best_halos = NULL;
+__thread int64_t *assign_todo = NULL;
+__thread int64_t alloced_params = 0, alloced_best_halos = 0;
 
 void build_subtree(struct halo **subs, int64_t num_subs) {
   int64_t i;
@@ -42,8 +54,14 @@ void build_subtree(struct halo **subs, int64_t num_subs) {
 
 void free_subtree(void) {
   fast3tree_free(&subtree);
+  if (subtree_res) fast3tree_results_free(subtree_res);
+  subtree_res = NULL;
   alloced_metrics = 0;
   sub_metric = check_realloc(sub_metric, 0, "Freeing halo metric tree.\n");
+  check_realloc_s(metric_params, 0, 0);
+  check_realloc_s(best_halos, 0, 0);
+  check_realloc_s(assign_todo, 0, 0);
+  alloced_params = alloced_best_halos = 0;
 }
 
 float calc_particle_dist(struct halo *h, struct particle *part) {
@@ -159,6 +177,190 @@ struct halo *find_best_halo(struct particle *part, struct halo *best_halo) {
 }
 
 
+/* Batched find_best_halo() for many particles at once.  Particles are
+   taken in blocks; each block walks the subhalo tree once, carrying along
+   only the particles for which a node could still hold a better halo.
+   Each particle sees the same nodes and halos in the same order as in
+   find_best_halo(), so the results are identical.  Halo properties used
+   by calc_particle_dist() are copied into a flat array beforehand, and
+   leaves are evaluated halo by halo across the block's active particles. */
+#define ASSIGN_BLOCK_SIZE 64
+#define ASSIGN_MIN_THREAD_PARTICLES 20000
+
+struct assign_block {
+  float pos[6][ASSIGN_BLOCK_SIZE], best[ASSIGN_BLOCK_SIZE];
+  int64_t dm[ASSIGN_BLOCK_SIZE];
+  struct halo *best_h[ASSIGN_BLOCK_SIZE];
+};
+
+struct assign_info {
+  struct fast3tree *tree;
+  struct metric_params *mp;
+  struct particle *parts;
+  int64_t *todo, num_todo, next;
+  struct halo *best_halo, **results;
+};
+
+void _calc_metric_params(struct fast3tree *t, struct metric_params *mp) {
+  int64_t i, j;
+  for (i=0; i<t->num_points; i++) {
+    struct halo *h = t->points[i].target;
+    for (j=0; j<3; j++) {
+      mp[i].pos[j] = h->pos[j];
+      mp[i].vel[j] = h->bulkvel[j];
+    }
+    mp[i].r2 = h->r*h->r;
+    mp[i].vrms2 = h->vrms*h->vrms;
+    mp[i].skip[0] = mp[i].skip[1] =
+      (h->vrms <= 0 || h->r <= 0 || h->num_p <= 0);
+    if (h->type != RTYPE_DM) mp[i].skip[1] = 1;
+    if (h->type == RTYPE_DM && (h->flags & GALAXY_INELIGIBLE_FLAG))
+      mp[i].skip[0] = 1;
+    mp[i].scale_v = (h->type == RTYPE_DM);
+  }
+}
+
+static inline int64_t _block_node_could_be_better(struct tree3_node *n,
+						  struct assign_block *b,
+						  int64_t j) {
+  float max_r = n->min[3]*b->best[j]*INV_RADIUS_WEIGHTING;
+  int64_t i;
+  for (i=0; i<3; i++)
+    if ((b->pos[i][j]+max_r < n->min[i]) || (b->pos[i][j]-max_r > n->max[i]))
+      return 0;
+  return 1;
+}
+
+/* Same as calc_particle_dist() for each halo in the leaf and each active
+   particle of the block.  The active particles are first packed into
+   contiguous lanes, so that the loop over them for each halo has no
+   branches or indirection and can be vectorized. */
+void _find_best_halos_leaf(struct tree3_node *n, struct assign_info *ai,
+			   struct assign_block *b, int64_t *active,
+			   int64_t num_active) {
+  float pos[6][ASSIGN_BLOCK_SIZE], best[ASSIGN_BLOCK_SIZE];
+  int32_t dm[ASSIGN_BLOCK_SIZE], best_i[ASSIGN_BLOCK_SIZE];
+  int32_t skip_dm, skip_non_dm;
+  double v_div[ASSIGN_BLOCK_SIZE], no_div[ASSIGN_BLOCK_SIZE], *div;
+  int64_t i, j, k;
+  for (k=0; k<num_active; k++) {
+    j = active[k];
+    for (i=0; i<6; i++) pos[i][k] = b->pos[i][j];
+    best[k] = b->best[j];
+    dm[k] = b->dm[j];
+    best_i[k] = -1;
+    v_div[k] = dm[k] ? 1 : NON_DM_METRIC_SCALING*NON_DM_METRIC_SCALING;
+    no_div[k] = 1;
+  }
+  for (i=0; i<n->num_points; i++) {
+    struct metric_params *mp = ai->mp + (n->points + i - ai->tree->points);
+    if (mp->skip[0] && mp->skip[1]) continue;
+    skip_dm = mp->skip[1];
+    skip_non_dm = mp->skip[0];
+    div = mp->scale_v ? v_div : no_div;
+    for (k=0; k<num_active; k++) {
+      float dx, r2=0, v2=0, metric;
+      int32_t better;
+      dx = mp->pos[0]-pos[0][k]; r2+=dx*dx;
+      dx = mp->pos[1]-pos[1][k]; r2+=dx*dx;
+      dx = mp->pos[2]-pos[2][k]; r2+=dx*dx;
+      dx = mp->vel[0]-pos[3][k]; v2+=dx*dx;
+      dx = mp->vel[1]-pos[4][k]; v2+=dx*dx;
+      dx = mp->vel[2]-pos[5][k]; v2+=dx*dx;
+      v2 /= div[k];
+      metric = sqrtf((r2 / mp->r2) + v2 / mp->vrms2);
+      better = !(dm[k] ? skip_dm : skip_non_dm) & (metric < best[k]);
+      best[k] = better ? metric : best[k];
+      best_i[k] = better ? i : best_i[k];
+    }
+  }
+  for (k=0; k<num_active; k++) {
+    if (best_i[k] < 0) continue;
+    j = active[k];
+    b->best[j] = best[k];
+    b->best_h[j] = n->points[best_i[k]].target;
+  }
+}
+
+void _find_best_halos_block(struct tree3_node *n, struct assign_info *ai,
+			    struct assign_block *b, int64_t *active,
+			    int64_t num_active) {
+  int64_t i, k, num_next, next[ASSIGN_BLOCK_SIZE];
+  struct tree3_node *children[2] = {n->left, n->right};
+  if (n->div_dim < 0) { //At leaf node
+    _find_best_halos_leaf(n, ai, b, active, num_active);
+    return;
+  }
+  for (i=0; i<2; i++) {
+    for (k=0, num_next=0; k<num_active; k++)
+      if (_block_node_could_be_better(children[i], b, active[k]))
+	next[num_next++] = active[k];
+    if (num_next) _find_best_halos_block(children[i], ai, b, next, num_next);
+  }
+}
+
+void _find_best_halos_thread(int64_t thread, void *data) {
+  struct assign_info *ai = data;
+  struct assign_block b;
+  int64_t i, j, k, start, end, active[ASSIGN_BLOCK_SIZE];
+  while ((start = next_thread_task(&ai->next)*ASSIGN_BLOCK_SIZE) < ai->num_todo) {
+    end = start + ASSIGN_BLOCK_SIZE;
+    if (end > ai->num_todo) end = ai->num_todo;
+    for (i=start; i<end; i++) {
+      struct particle *part = ai->parts + ai->todo[i];
+      j = i - start;
+      for (k=0; k<6; k++) b.pos[k][j] = part->pos[k];
+      b.dm[j] = (part->type == RTYPE_DM);
+      b.best[j] = calc_particle_dist(ai->best_halo, part);
+      b.best_h[j] = ai->best_halo;
+      active[j] = j;
+    }
+    _find_best_halos_block(ai->tree->root, ai, &b, active, end-start);
+    for (i=start; i<end; i++) ai->results[ai->todo[i]] = b.best_h[i-start];
+  }
+}
+
+/* Finds the best halo in the current subhalo tree for each particle
+   parts[i] with assigned[i] < 0, starting from best_halo as in
+   find_best_halo().  Returns an array with these halos (NULL for particles
+   that were already assigned), valid until the next call. */
+struct halo **find_best_halos(struct particle *parts, int64_t *assigned,
+			      int64_t num_p, struct halo *best_halo,
+			      int64_t num_threads) {
+  int64_t i;
+  struct assign_info ai = {0};
+  if (num_p > alloced_best_halos) {
+    alloced_best_halos = num_p;
+    check_realloc_s(best_halos, sizeof(struct halo *), num_p);
+    check_realloc_s(assign_todo, sizeof(int64_t), num_p);
+  }
+  for (i=0; i<num_p; i++) {
+    best_halos[i] = NULL;
+    if (assigned[i] < 0) assign_todo[ai.num_todo++] = i;
+  }
+  if (ALT_NFW_METRIC) {
+    for (i=0; i<ai.num_todo; i++)
+      best_halos[assign_todo[i]] = find_best_halo(parts+assign_todo[i], best_halo);
+    return best_halos;
+  }
+
+  if (subtree->num_points > alloced_params) {
+    alloced_params = subtree->num_points;
+    check_realloc_s(metric_params, sizeof(struct metric_params), alloced_params);
+  }
+  _calc_metric_params(subtree, metric_params);
+  ai.tree = subtree;
+  ai.mp = metric_params;
+  ai.parts = parts;
+  ai.todo = assign_todo;
+  ai.best_halo = best_halo;
+  ai.results = best_halos;
+  if (ai.num_todo < ASSIGN_MIN_THREAD_PARTICLES || num_threads < 1) num_threads = 1;
+  run_threads(num_threads, _find_best_halos_thread, &ai);
+  return best_halos;
+}
+
+
 int64_t node_could_be_better_parent(struct tree3_node *n, struct halo *h,
 				    float best_metric) {
   float r = n->min[3]*INV_RADIUS_WEIGHTING;
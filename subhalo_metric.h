@@ -10,6 +10,9 @@ struct halo_metric {
 
 void build_subtree(struct halo **subs, int64_t num_subs);
 struct halo *find_best_halo(struct particle *part, struct halo *best_halo);
+struct halo **find_best_halos(struct particle *parts, int64_t *assigned,
+			      int64_t num_p, struct halo *best_halo,
+			      int64_t num_threads);
 struct halo *find_best_parent(struct halo *h, struct halo *biggest_halo);
 float calc_particle_dist(struct halo *h, struct particle *part);
 float _calc_halo_dist(struct halo *h1, struct halo *h2);
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "check_syscalls.h"
+#include "threads.h"
+
+struct thread_args {
+  int64_t thread;
+  thread_func func;
+  void *data;
+};
+
+void *_run_thread(void *args) {
+  struct thread_args *ta = args;
+  ta->func(ta->thread, ta->data);
+  return NULL;
+}
+
+//Runs func(thread, data) on num_threads threads; the calling thread is
+//thread 0.  Returns once all threads have finished.
+void run_threads(int64_t num_threads, thread_func func, void *data) {
+  int64_t i;
+  pthread_t *threads = NULL;
+  struct thread_args *ta = NULL;
+  if (num_threads < 2) { func(0, data); return; }
+  check_realloc_s(threads, sizeof(pthread_t), num_threads);
+  check_realloc_s(ta, sizeof(struct thread_args), num_threads);
+  for (i=0; i<num_threads; i++) {
+    ta[i].thread = i;
+    ta[i].func = func;
+    ta[i].data = data;
+  }
+  for (i=1; i<num_threads; i++)
+    if (pthread_create(threads+i, NULL, _run_thread, ta+i))
+      system_error("Failed to create new thread!");
+  func(0, data);
+  for (i=1; i<num_threads; i++)
+    if (pthread_join(threads[i], NULL))
+      system_error("Failed to join thread!");
+  free(threads);
+  free(ta);
+}
+
+//Atomically claims the next task number from a shared counter.
+int64_t next_thread_task(int64_t *counter) {
+  return __sync_fetch_and_add(counter, 1);
+}
+
+//Atomically takes up to max threads from a shared count of idle threads;
+//returns the number taken, which must later be given back.
+int64_t claim_idle_threads(int64_t *pool, int64_t max) {
+  int64_t avail, taken;
+  do {
+    avail = __atomic_load_n(pool, __ATOMIC_RELAXED);
+    if (avail < 1 || max < 1) return 0;
+    taken = (avail < max) ? avail : max;
+  } while (!__sync_bool_compare_and_swap(pool, avail, avail-taken));
+  return taken;
+}
+
+void release_idle_threads(int64_t *pool, int64_t n) {
+  __sync_fetch_and_add(pool, n);
+}
@@ -0,0 +1,12 @@
+#ifndef _THREADS_H_
+#define _THREADS_H_
+#include <stdint.h>
+
+typedef void (*thread_func)(int64_t thread, void *data);
+
+void run_threads(int64_t num_threads, thread_func func, void *data);
+int64_t next_thread_task(int64_t *counter);
+int64_t claim_idle_threads(int64_t *pool, int64_t max);
+void release_idle_threads(int64_t *pool, int64_t n);
+
+#endif /* _THREADS_H_ */
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include "check_syscalls.h"
+#include "union_find.h"
+
+//Resets uf to n singleton sets; memory is only reallocated if n grows.
+void uf_init(struct union_find *uf, int64_t n) {
+  int64_t i;
+  assert(n <= (int64_t)UF_PARENT_MASK);
+  if (n > uf->num_alloced_nodes) {
+    check_realloc_s(uf->nodes, sizeof(uint64_t), n);
+    uf->num_alloced_nodes = n;
+  }
+  for (i=0; i<n; i++) uf->nodes[i] = UF_NODE(i, 0);
+  uf->num_nodes = n;
+}
+
+void uf_union_callback(void *data, int64_t a, int64_t b) {
+  uf_union(data, a, b);
+}
+
+void uf_free(struct union_find *uf) {
+  check_realloc_s(uf->nodes, 0, 0);
+  uf->num_nodes = uf->num_alloced_nodes = 0;
+}
+
+//Numbers each non-singleton set in order of its lowest element, storing
+//the set numbers in labels[] (-1 for singletons).  This overwrites the
+//set structure, so uf_init() must be called again before reuse.
+//Returns the number of sets found.
+int64_t uf_label_sets(struct union_find *uf, int64_t *labels) {
+  int64_t i, r, num_labels = 0;
+  for (i=0; i<uf->num_nodes; i++)
+    labels[i] = uf_is_singleton(uf, i) ? -1 : uf_find(uf, i);
+  for (i=0; i<uf->num_nodes; i++) {
+    if (labels[i] < 0) continue;
+    r = labels[i];
+    if (!(uf->nodes[r] & UF_LABELED)) uf->nodes[r] = UF_LABELED | num_labels++;
+    labels[i] = UF_PARENT(uf->nodes[r]);
+  }
+  return num_labels;
+}
@@ -0,0 +1,81 @@
+#ifndef _UNION_FIND_H_
+#define _UNION_FIND_H_
+#include <stdint.h>
+
+/* Concurrent union-find over the integers 0..n-1, using union by rank and
+   path halving.  Each element is a single 64-bit word holding its parent
+   (low 56 bits) and rank (high 8 bits), so that linking a root and
+   raising its rank are both single compare-and-swap operations.  Any
+   number of threads may call uf_find() and uf_union() at once; nodes
+   are read with relaxed atomic loads so that those reads do not race
+   with the compare-and-swaps of other threads. */
+
+#define UF_LOAD(uf,x) __atomic_load_n((uf)->nodes + (x), __ATOMIC_RELAXED)
+
+#define UF_RANK_SHIFT 56
+#define UF_PARENT_MASK ((((uint64_t)1)<<UF_RANK_SHIFT)-1)
+#define UF_PARENT(x) ((int64_t)((x) & UF_PARENT_MASK))
+#define UF_RANK(x) ((x) >> UF_RANK_SHIFT)
+#define UF_LABELED (((uint64_t)1)<<63)
+#define UF_NODE(parent,rank) (((uint64_t)(parent)) | (((uint64_t)(rank))<<UF_RANK_SHIFT))
+
+struct union_find {
+  uint64_t *nodes;
+  int64_t num_nodes, num_alloced_nodes;
+};
+
+void uf_init(struct union_find *uf, int64_t n);
+void uf_free(struct union_find *uf);
+int64_t uf_label_sets(struct union_find *uf, int64_t *labels);
+
+static inline int64_t uf_find(struct union_find *uf, int64_t x) {
+  uint64_t n = UF_LOAD(uf, x), pn;
+  int64_t p = UF_PARENT(n), g;
+  while (p != x) {
+    pn = UF_LOAD(uf, p);
+    g = UF_PARENT(pn);
+    if (g != p) //Path halving
+      __sync_bool_compare_and_swap(uf->nodes + x, n, UF_NODE(g, UF_RANK(n)));
+    x = p;
+    n = pn;
+    p = g;
+  }
+  return x;
+}
+
+//Returns the new root of the merged set.
+static inline int64_t uf_union(struct union_find *uf, int64_t a, int64_t b) {
+  uint64_t na, nb, tn;
+  int64_t tmp;
+  while (1) {
+    a = uf_find(uf, a);
+    b = uf_find(uf, b);
+    if (a == b) return a;
+    na = UF_LOAD(uf, a);
+    nb = UF_LOAD(uf, b);
+    if (UF_PARENT(na) != a || UF_PARENT(nb) != b) continue;
+    //Link the root with lower rank (or, for equal ranks, the higher
+    //index) below the other one.  Ranks only grow while a node is a root,
+    //so this ordering can never produce a cycle.
+    if (UF_RANK(na) > UF_RANK(nb) || (UF_RANK(na) == UF_RANK(nb) && a < b)) {
+      tmp = a; a = b; b = tmp;
+      tn = na; na = nb; nb = tn;
+    }
+    if (!__sync_bool_compare_and_swap(uf->nodes + a, na, UF_NODE(b, UF_RANK(na))))
+      continue;
+    if (UF_RANK(na) == UF_RANK(nb))
+      __sync_bool_compare_and_swap(uf->nodes + b, nb, UF_NODE(b, UF_RANK(nb)+1));
+    return b;
+  }
+}
+
+//uf_union() as a callback (e.g., for fast3tree_link_pairs()); data is the
+//union_find.
+void uf_union_callback(void *data, int64_t a, int64_t b);
+
+//True if x has not (yet) been merged with any other element.
+static inline int uf_is_singleton(struct union_find *uf, int64_t x) {
+  return (UF_LOAD(uf, x) == UF_NODE(x, 0));
+}
+
+#endif /* _UNION_FIND_H_ */
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "../config_vars.h"
+#include "../config.h"
+#include "../check_syscalls.h"
+#include "../rockstar.h"
+#include "../groupies.h"
+#include "../subhalo_metric.h"
+#include "../io/meta_io.h"
+
+/* Finds halos in a particle snapshot, and then times the assignment of
+   every particle to its best halo (as done for unassigned particles in
+   find_subs()) with find_best_halo() one particle at a time and with
+   find_best_halos() in batches, checking that both agree.
+   Usage: assign_bench [-c config] [-r repeats] particle_file1 ... */
+
+int main(int argc, char **argv) {
+  int64_t i, rep, repeats = 3, did_config = 0, num_subs = 0, max_i = 0;
+  int64_t *assigned = NULL, num_threads;
+  struct halo **subs = NULL, **best = NULL, **batched;
+  double start, t, best_t[3] = {0};
+  char *names[3] = {"single", "batched (1 thread)", "batched"};
+
+  for (i=1; i<argc-1; i++) {
+    if (!strcmp("-c", argv[i])) { do_config(argv[i+1]); i++; did_config=1; }
+    else if (!strcmp("-r", argv[i])) { repeats = atoi(argv[i+1]); i++; }
+  }
+  if (!did_config) do_config(NULL);
+  if (repeats < 1) repeats = 1;
+  for (i=1; i<argc; i++) {
+    if (!strcmp("-c", argv[i]) || !strcmp("-r", argv[i])) i++;
+    else read_particles(argv[i]);
+  }
+  if (!num_p) {
+    fprintf(stderr, "Usage: %s [-c config] [-r repeats] particle_file1 ...\n",
+	    argv[0]);
+    exit(1);
+  }
+
+  rockstar(NULL, 0);
+  check_realloc_s(subs, sizeof(struct halo *), num_halos);
+  for (i=0; i<num_halos; i++) {
+    if (halos[i].num_p <= 0) continue;
+    if (halos[i].num_p > halos[max_i].num_p) max_i = i;
+    subs[num_subs++] = halos + i;
+  }
+  if (num_subs < 2) {
+    fprintf(stderr, "[Error] Too few halos (%"PRId64") to benchmark.\n", num_subs);
+    exit(1);
+  }
+  build_subtree(subs, num_subs);
+  check_realloc_s(best, sizeof(struct halo *), num_p);
+  check_realloc_s(assigned, sizeof(int64_t), num_p);
+  for (i=0; i<num_p; i++) assigned[i] = -1;
+
+  for (rep=0; rep<repeats; rep++) {
+    start = wall_time();
+    for (i=0; i<num_p; i++) best[i] = find_best_halo(p+i, halos+max_i);
+    t = wall_time() - start;
+    if (!rep || t < best_t[0]) best_t[0] = t;
+
+    for (num_threads=1; num_threads<=NUM_THREADS; num_threads=NUM_THREADS) {
+      start = wall_time();
+      batched = find_best_halos(p, assigned, num_p, halos+max_i, num_threads);
+      t = wall_time() - start;
+      if (!rep || t < best_t[1+(num_threads>1)])
+	best_t[1+(num_threads>1)] = t;
+      for (i=0; i<num_p; i++) {
+	if (batched[i] != best[i]) {
+	  printf("[Error] Best halos differ for particle %"PRId64"!\n", i);
+	  return 1;
+	}
+      }
+      if (num_threads == NUM_THREADS) break;
+    }
+  }
+
+  printf("#Particles: %"PRId64"; Halos: %"PRId64"; Threads: %"PRId64"; Repeats: %"PRId64"\n",
+	 num_p, num_subs, NUM_THREADS, repeats);
+  for (i=0; i<3; i++) {
+    if (i==2 && NUM_THREADS < 2) break;
+    printf("%s: %f s (%.2fx)\n", names[i], best_t[i], best_t[0]/best_t[i]);
+  }
+  printf("Best halos identical.\n");
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "../config_vars.h"
+#include "../config.h"
+#include "../check_syscalls.h"
+#include "../rockstar.h"
+#include "../fof.h"
+#include "../io/meta_io.h"
+
+/* Times the 3D FOF stage of rockstar() with the tree (FOF_GRID=0) and the
+   grid (FOF_GRID=1), and checks that both give identical FOF groups.
+   Usage: fof_bench [-c config] [-r repeats] particle_file1 ... */
+
+uint64_t fof_checksum(void) {
+  int64_t i, j;
+  uint64_t sum = num_all_fofs;
+  for (i=0; i<num_all_fofs; i++) {
+    sum = sum*31 + all_fofs[i].num_p;
+    for (j=0; j<all_fofs[i].num_p; j++)
+      sum = sum*31 + all_fofs[i].particles[j].id;
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  int64_t i, engine, rep, repeats = 3, did_config = 0, num_fofs[2] = {0};
+  struct particle *orig_p = NULL;
+  int64_t orig_num_p;
+  uint64_t sums[2] = {0};
+  double start, t, best[2] = {0};
+  char *names[2] = {"tree", "grid"};
+
+  for (i=1; i<argc-1; i++) {
+    if (!strcmp("-c", argv[i])) { do_config(argv[i+1]); i++; did_config=1; }
+    else if (!strcmp("-r", argv[i])) { repeats = atoi(argv[i+1]); i++; }
+  }
+  if (!did_config) do_config(NULL);
+  if (repeats < 1) repeats = 1;
+  for (i=1; i<argc; i++) {
+    if (!strcmp("-c", argv[i]) || !strcmp("-r", argv[i])) i++;
+    else read_particles(argv[i]);
+  }
+  if (!num_p) {
+    fprintf(stderr, "Usage: %s [-c config] [-r repeats] particle_file1 ...\n",
+	    argv[0]);
+    exit(1);
+  }
+
+  orig_num_p = num_p;
+  check_realloc_s(orig_p, sizeof(struct particle), num_p);
+  memcpy(orig_p, p, sizeof(struct particle)*num_p);
+  for (rep=0; rep<repeats; rep++) {
+    for (engine=0; engine<2; engine++) {
+      num_p = orig_num_p;
+      memcpy(p, orig_p, sizeof(struct particle)*num_p);
+      FOF_GRID = engine;
+      start = wall_time();
+      rockstar(NULL, 1);
+      t = wall_time() - start;
+      if (!rep || t < best[engine]) best[engine] = t;
+      num_fofs[engine] = num_all_fofs;
+      sums[engine] = fof_checksum();
+      rockstar_cleanup();
+    }
+  }
+
+  printf("#Particles: %"PRId64"; Threads: %"PRId64"; Repeats: %"PRId64"\n",
+	 orig_num_p, NUM_THREADS, repeats);
+  for (engine=0; engine<2; engine++)
+    printf("%s: %f s (%"PRId64" FOFs)\n", names[engine], best[engine],
+	   num_fofs[engine]);
+  if (num_fofs[0] != num_fofs[1] || sums[0] != sums[1]) {
+    printf("[Error] FOF groups differ between tree and grid!\n");
+    return 1;
+  }
+  printf("FOF groups identical; speedup: %.2fx\n", best[0]/best[1]);
+  return 0;
+}
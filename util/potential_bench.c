@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+#include <string.h>
+#include "../config_vars.h"
+#include "../config.h"
+#include "../check_syscalls.h"
+#include "../rockstar.h"
+#include "../potential.h"
+
+/* Times compute_potential() with the Barnes-Hut tree and with the fast
+   multipole method on a synthetic Hernquist halo, and compares both with
+   the direct sum for a random sample of particles.  The direct time is
+   extrapolated from the sample.  Each method is run over a range of its
+   accuracy parameter (the Barnes-Hut error tolerance and the FMM opening
+   angle), and the FMM times are then compared with the Barnes-Hut times
+   at the same rms error (interpolated between Barnes-Hut runs).
+   Usage: potential_bench [-c config] [-r repeats] [-s samples] num_particles */
+
+#define HERNQUIST_A 0.05 //Scale radius, in Mpc/h
+#define HERNQUIST_MAX_R 1.0
+#define NUM_BH_TOLS 7
+#define NUM_FMM_THETAS 6
+
+double bh_tols[NUM_BH_TOLS] = {0.01, 0.02, 0.05, 0.1, 0.25, 0.5, 1};
+double fmm_thetas[NUM_FMM_THETAS] = {0.4, 0.5, 0.6, 0.7, 0.8, 0.9};
+
+struct bench_result {
+  double t, rms_err, max_err;
+};
+
+double direct_potential(struct potential *po, int64_t num_po, int64_t i) {
+  int64_t j, k;
+  double r2, dx, r, pe = 0;
+  for (j=0; j<num_po; j++) {
+    if (j==i) continue;
+    for (k=0, r2=0; k<3; k++) { dx = po[i].pos[k]-po[j].pos[k]; r2 += dx*dx; }
+    r = sqrt(r2);
+    if (r < FORCE_RES) r = FORCE_RES;
+    pe += po[j].mass/r;
+  }
+  return pe;
+}
+
+//Best time over repeats, and errors against the sampled direct sums.
+//compute_potential() reorders particles, so they are tagged with their
+//original index in the type field.
+struct bench_result run_method(struct potential *po, struct potential *po2,
+			       int64_t num_po, int64_t fmm, int64_t repeats,
+			       int64_t *samples, double *ref, int64_t num_samples) {
+  int64_t i, rep;
+  double start, t, err;
+  struct bench_result br = {0};
+  FMM_MIN_PARTICLES = fmm ? 1 : 0;
+  for (rep=0; rep<repeats; rep++) {
+    memcpy(po2, po, sizeof(struct potential)*num_po);
+    for (i=0; i<num_po; i++) po2[i].type = i;
+    start = wall_time();
+    compute_potential(po2, num_po, NUM_THREADS);
+    t = wall_time() - start;
+    if (!rep || t < br.t) br.t = t;
+  }
+  for (i=0; i<num_po; i++) po[po2[i].type].pe = po2[i].pe;
+  for (i=0; i<num_samples; i++) {
+    err = fabs(po[samples[i]].pe - ref[i])/ref[i];
+    if (err > br.max_err) br.max_err = err;
+    br.rms_err += err*err;
+  }
+  br.rms_err = sqrt(br.rms_err/num_samples);
+  return br;
+}
+
+//Barnes-Hut time at the given rms error, interpolating log(time) in
+//log(error) between consecutive runs; -1 if out of range.
+double bh_time_at_error(struct bench_result *bh, double rms_err) {
+  int64_t i;
+  double f, e1, e2;
+  for (i=0; i<NUM_BH_TOLS-1; i++) {
+    e1 = bh[i].rms_err;
+    e2 = bh[i+1].rms_err;
+    if (rms_err < e1 && rms_err < e2) continue;
+    if (rms_err > e1 && rms_err > e2) continue;
+    if (e1 == e2) return bh[i].t;
+    f = log(rms_err/e1)/log(e2/e1);
+    return exp(log(bh[i].t) + f*log(bh[i+1].t/bh[i].t));
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int64_t i, repeats = 3, num_samples = 1000, num_po = 0;
+  int64_t did_config = 0, *samples = NULL;
+  struct potential *po = NULL, *po2 = NULL;
+  double start, t_direct, u, r, c, phi, s, t_bh;
+  double *ref = NULL;
+  struct bench_result bh[NUM_BH_TOLS], fmm[NUM_FMM_THETAS];
+
+  for (i=1; i<argc; i++) {
+    if (i<argc-1 && !strcmp("-c", argv[i])) { do_config(argv[i+1]); i++; did_config=1; }
+    else if (i<argc-1 && !strcmp("-r", argv[i])) { repeats = atoi(argv[i+1]); i++; }
+    else if (i<argc-1 && !strcmp("-s", argv[i])) { num_samples = atol(argv[i+1]); i++; }
+    else num_po = atol(argv[i]);
+  }
+  if (!did_config) do_config(NULL);
+  if (num_po < 2) {
+    fprintf(stderr, "Usage: %s [-c config] [-r repeats] [-s samples] num_particles\n",
+	    argv[0]);
+    exit(1);
+  }
+  if (repeats < 1) repeats = 1;
+  if (num_samples < 1) num_samples = 1;
+  if (num_samples > num_po) num_samples = num_po;
+
+  check_realloc_s(po, sizeof(struct potential), num_po);
+  check_realloc_s(po2, sizeof(struct potential), num_po);
+  memset(po, 0, sizeof(struct potential)*num_po);
+  srand48(1);
+  for (i=0; i<num_po; i++) {
+    do {
+      u = sqrt(drand48());
+      r = (u < 1) ? HERNQUIST_A*u/(1.0-u) : HERNQUIST_MAX_R;
+    } while (r >= HERNQUIST_MAX_R);
+    c = 2.0*drand48()-1.0;
+    phi = 2.0*M_PI*drand48();
+    s = sqrt(1.0-c*c);
+    po[i].pos[0] = r*s*cos(phi);
+    po[i].pos[1] = r*s*sin(phi);
+    po[i].pos[2] = r*c;
+    po[i].mass = 1;
+  }
+
+  check_realloc_s(samples, sizeof(int64_t), num_samples);
+  check_realloc_s(ref, sizeof(double), num_samples);
+  start = wall_time();
+  for (i=0; i<num_samples; i++) {
+    samples[i] = (num_samples == num_po) ? i : (int64_t)(drand48()*num_po);
+    ref[i] = direct_potential(po, num_po, samples[i]);
+  }
+  t_direct = (wall_time() - start)*num_po/num_samples;
+
+  printf("#Particles: %"PRId64"; Samples: %"PRId64"; Repeats: %"PRId64"; Force res: %g\n",
+	 num_po, num_samples, repeats, FORCE_RES);
+  printf("#Direct (est.): %f s\n", t_direct);
+  printf("#Method Parameter Time(s) Speedup RMS_error Max_error\n");
+  for (i=0; i<NUM_BH_TOLS; i++) {
+    potential_err_tol = bh_tols[i];
+    bh[i] = run_method(po, po2, num_po, 0, repeats, samples, ref, num_samples);
+    printf("Barnes-Hut err_tol=%g %f %.1fx %.2e %.2e\n", bh_tols[i], bh[i].t,
+	   t_direct/bh[i].t, bh[i].rms_err, bh[i].max_err);
+  }
+  for (i=0; i<NUM_FMM_THETAS; i++) {
+    potential_fmm_theta = fmm_thetas[i];
+    fmm[i] = run_method(po, po2, num_po, 1, repeats, samples, ref, num_samples);
+    printf("FMM theta=%g %f %.1fx %.2e %.2e\n", fmm_thetas[i], fmm[i].t,
+	   t_direct/fmm[i].t, fmm[i].rms_err, fmm[i].max_err);
+  }
+
+  printf("#At matched rms error:\n");
+  printf("#FMM_theta RMS_error FMM_time(s) Barnes-Hut_time(s) FMM_speedup\n");
+  for (i=0; i<NUM_FMM_THETAS; i++) {
+    t_bh = bh_time_at_error(bh, fmm[i].rms_err);
+    if (t_bh < 0)
+      printf("%g %.2e %f n/a n/a\n", fmm_thetas[i], fmm[i].rms_err, fmm[i].t);
+    else
+      printf("%g %.2e %f %f %.2fx\n", fmm_thetas[i], fmm[i].rms_err, fmm[i].t,
+	     t_bh, t_bh/fmm[i].t);
+  }
+  return 0;
+}